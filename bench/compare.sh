@@ -0,0 +1,73 @@
+#!/bin/sh
+#
+# Compares benchmark results against a baseline, both as written by run.sh,
+# and flags every metric that has got worse by more than a threshold.
+#
+# Usage: bench/compare.sh BASELINE CURRENT [THRESHOLD_PERCENT]
+#
+# Throughput is better higher, everything else (latency, CPU time and memory)
+# is better lower. Exits with status 1 if any metric regressed.
+
+set -eu
+
+if [ $# -lt 2 ] || [ $# -gt 3 ]; then
+    echo "Usage: $0 BASELINE CURRENT [THRESHOLD_PERCENT]" >&2
+    exit 1
+fi
+
+threshold=${3:-10}
+
+# run.sh writes one metric per line, inside one object per scenario, which is
+# all the parsing needed here.
+awk -v threshold="$threshold" '
+    FNR == 1 { file++ }
+
+    /^    "[a-z_]+": \{/ {
+        scenario = $1
+        gsub(/[":]/, "", scenario)
+        next
+    }
+
+    /^      "[a-z0-9_]+": / {
+        metric = $1
+        value = $2
+        gsub(/[":]/, "", metric)
+        sub(/,$/, "", value)
+        key = scenario SUBSEP metric
+
+        if (file == 1) {
+            baseline[key] = value
+        } else {
+            current[key] = value
+            order[++n] = key
+        }
+    }
+
+    END {
+        printf "%-16s %-20s %14s %14s %9s\n", "scenario", "metric", "baseline", "current", "change"
+
+        for (i = 1; i <= n; ++i) {
+            key = order[i]
+            split(key, parts, SUBSEP)
+
+            if (!(key in baseline)) {
+                printf "%-16s %-20s %14s %14s %9s\n", parts[1], parts[2], "-", current[key], "new"
+                continue
+            }
+
+            old = baseline[key] + 0
+            new = current[key] + 0
+            change = old != 0 ? (new - old) / old * 100 : 0
+            worse = parts[2] ~ /^throughput/ ? -change : change
+            flag = worse > threshold ? "  REGRESSION" : ""
+
+            if (flag != "")
+                regressions++
+
+            printf "%-16s %-20s %14s %14s %+8.1f%%%s\n", parts[1], parts[2], baseline[key], current[key], change, flag
+        }
+
+        printf "%d regression(s) beyond %s%%\n", regressions, threshold
+        exit regressions > 0
+    }
+' "$1" "$2"
@@ -0,0 +1,177 @@
+#!/bin/sh
+#
+# Builds the server and client, runs a fixed set of benchmark scenarios over
+# loopback and prints the results as JSON.
+#
+# Usage: bench/run.sh [-d SECONDS] [-p PORT] [-o FILE]
+#
+# The compiler and its flags are taken from CC and CFLAGS.
+
+set -eu
+
+CC=${CC:-gcc}
+CFLAGS=${CFLAGS:--O2}
+
+duration=5
+port=1338
+output=-
+
+while getopts d:p:o: opt; do
+    case $opt in
+        d) duration=$OPTARG ;;
+        p) port=$OPTARG ;;
+        o) output=$OPTARG ;;
+        *) echo "Usage: $0 [-d SECONDS] [-p PORT] [-o FILE]" >&2; exit 1 ;;
+    esac
+done
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+server_pid=
+
+cleanup() {
+    if [ -n "$server_pid" ]; then
+        kill "$server_pid" 2>/dev/null || true
+    fi
+
+    rm -rf "$work"
+}
+
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+echo "Building with $CC $CFLAGS" >&2
+$CC $CFLAGS -pthread -o "$work/server" "$root/server.c" "$root/timeout_server.c" "$root/timer.c" "$root/table.c" "$root/ring.c" "$root/pipeline.c" "$root/sockets.c" "$root/workers.c" -lrt
+$CC $CFLAGS -o "$work/client" "$root/client.c"
+
+# Start the server with the given options, and wait until it is listening.
+start_server() {
+    "$work/server" -p "$port" "$@" >/dev/null 2>"$work/server.log" &
+    server_pid=$!
+
+    tries=0
+    until grep -q "Server initialised" "$work/server.log"; do
+        tries=$((tries + 1))
+
+        if [ $tries -gt 50 ] || ! kill -0 "$server_pid" 2>/dev/null; then
+            echo "Server failed to start:" >&2
+            cat "$work/server.log" >&2
+            exit 1
+        fi
+
+        sleep 0.1
+    done
+}
+
+# Interrupt the server, which reports its resource usage as it shuts down.
+stop_server() {
+    kill -INT "$server_pid"
+    wait "$server_pid" || true
+    server_pid=
+}
+
+# Print a scenario's results as a JSON object, from the client's summary and
+# the server's log. The throughput is the rate of the scenario's unit of work,
+# and the latency figures are those of the last distribution the client
+# reported.
+results() {
+    awk -v name="$1" '
+        FNR == NR && /^Throughput:/ { throughput = $2 }
+        FNR == NR && /^Churn rate:/ { throughput = $3 }
+        FNR == NR && /^  mean / { latency = $0 }
+        FNR != NR && /^Resource usage:/ { cpu = $3 + $6; rss = $9 }
+
+        END {
+            printf "    \"%s\": {\n", name
+
+            if (throughput != "")
+                printf "      \"throughput_per_s\": %s,\n", throughput
+
+            n = split(latency, fields, ", ")
+
+            for (i = 1; i <= n; ++i) {
+                split(fields[i], kv, " ")
+                key = kv[1]
+                gsub(/\./, "", key)
+                printf "      \"latency_%s_us\": %s,\n", key, kv[2]
+            }
+
+            printf "      \"server_cpu_s\": %.3f,\n", cpu
+            printf "      \"server_max_rss\": %d\n", rss
+            printf "    }"
+        }
+    ' "$work/client.out" "$work/server.log"
+}
+
+# Run one scenario: its name, the server's options and the client's options,
+# separated by --.
+scenario() {
+    name=$1
+    shift
+
+    server_args=
+    while [ "$1" != -- ]; do
+        server_args="$server_args $1"
+        shift
+    done
+    shift
+
+    echo "Running $name" >&2
+
+    # shellcheck disable=SC2086
+    start_server $server_args
+    "$work/client" -p "$port" "$@" >"$work/client.out" 2>"$work/client.log" || {
+        echo "Client failed in $name:" >&2
+        cat "$work/client.log" >&2
+        exit 1
+    }
+    stop_server
+
+    if [ -n "$separator" ]; then
+        printf ",\n" >>"$work/results.json"
+    fi
+
+    results "$name" >>"$work/results.json"
+    separator=yes
+}
+
+separator=
+: >"$work/results.json"
+
+# Steady ingest: open-loop frames on many connections, timed to their
+# acknowledgement.
+scenario ingest -n 64 -k -- -m load -k -o -c 50 -r 2000 -d "$duration"
+
+# Idle swarm: silent connections, timed against the server's deadline.
+scenario idle -n 64 -t 1 -- -m idle -c 50 -t 1 -d 3
+
+# Churn: connections opened at a steady rate, each sending a few frames.
+# Connections the clients have closed hold their slots until the server
+# reaps them, so there are slots to spare, lest new connections be turned
+# away and the scenario time the kernel's SYN retransmits instead.
+scenario churn -n 1024 -- -m churn -c 50 -r 2000 -d "$duration"
+
+# Burst reconnect: connections opened as fast as they are accepted, with as
+# many slots to spare.
+scenario burst_reconnect -n 1024 -- -m churn -c 50 -r 0 -f 1 -d "$duration"
+
+# Echo latency: one frame in flight per connection, timed round trip.
+scenario echo -n 64 -e -- -m pingpong -c 16 -r 0 -d "$duration"
+
+{
+    printf "{\n"
+    printf "  \"commit\": \"%s\",\n" "$(git -C "$root" rev-parse --short HEAD 2>/dev/null || echo unknown)"
+    printf "  \"date\": \"%s\",\n" "$(date -u +%Y-%m-%dT%H:%M:%SZ)"
+    printf "  \"duration_s\": %s,\n" "$duration"
+    printf "  \"scenarios\": {\n"
+    cat "$work/results.json"
+    printf "\n  }\n"
+    printf "}\n"
+} >"$work/report.json"
+
+if [ "$output" = - ]; then
+    cat "$work/report.json"
+else
+    cp "$work/report.json" "$output"
+    echo "Results written to $output" >&2
+fi
@@ -0,0 +1,731 @@
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "../timeout_server.h"
+#include "../timer.h"
+
+
+/* Runs the server's event loop against a simulated clock and in-memory
+ * clients, and checks that every client left silent is timed out exactly on
+ * its deadline. Time only moves when the server waits, and then straight to
+ * the next scripted event or timer deadline, so hours of virtual time take
+ * seconds.
+ */
+
+
+/* Default number of clients over the run, and of connection slots in the
+ * server (including the listening socket's). Clients beyond the slots are
+ * turned away.
+ */
+static const size_t CLIENTS = 100000U;
+static const size_t SLOTS = 16384U;
+
+/* Default virtual time over which clients connect, and the server's client
+ * timeout, in seconds.
+ */
+static const double DURATION = 3600.0;
+static const double TIMEOUT = 30.0;
+
+/* Default maximum time between a client's heartbeats in seconds, and maximum
+ * number of heartbeats it sends before closing or going silent.
+ */
+static const double INTERVAL = 10.0;
+static const size_t BEATS = 30U;
+
+/* Default seed for the clients' scripts. */
+static const uint64_t SEED = 1U;
+
+/* Handle of the listening socket. Client c's handle is c + 1. */
+static const int LISTENER = 0;
+
+static const uint64_t NSEC_PER_SEC = 1000000000U;
+
+
+/* Run configuration, filled from the defaults above and the command line. */
+struct options {
+    size_t clients;
+    size_t slots;
+    uint64_t duration;
+    struct timespec timeout;
+    uint64_t interval;
+    size_t beats;
+    uint64_t seed;
+};
+
+enum client_state {
+    /* Yet to connect. */
+    CLIENT_PENDING,
+
+    /* Waiting for the server to accept it. */
+    CLIENT_QUEUED,
+
+    CLIENT_CONNECTED,
+
+    /* Turned away for want of a slot, and not yet closed by the server. */
+    CLIENT_REJECTED,
+
+    /* Closed by the server. */
+    CLIENT_DONE
+};
+
+/* A scripted client: it connects, sends heartbeats at random intervals, and
+ * then either closes or goes silent and waits to be timed out.
+ */
+struct client {
+    enum client_state state;
+
+    /* Time of its next scripted event, or UINT64_MAX if there is none. */
+    uint64_t at;
+
+    /* Heartbeats left to send, and whether it closes after the last rather
+     * than going silent.
+     */
+    size_t beats;
+    bool closes;
+
+    /* Heartbeats sent but not read yet, and whether it has closed. */
+    size_t unread;
+    bool eof;
+
+    /* Whether it is on the list of clients that may be readable. */
+    bool listed;
+
+    /* The server's slot for it, and the last time the server armed its
+     * timer.
+     */
+    size_t slot;
+    uint64_t armed_at;
+};
+
+/* What happened over the run. */
+struct stats {
+    uintmax_t events;
+    uintmax_t frames;
+    uintmax_t accepted;
+    uintmax_t rejected;
+    uintmax_t closed;
+    uintmax_t timed_out;
+    uintmax_t early;
+    uintmax_t late;
+    uintmax_t missed;
+};
+
+struct sim {
+    const struct options *opts;
+    uint64_t timeout;
+
+    /* Virtual time in nanoseconds. */
+    uint64_t now;
+
+    struct client *clients;
+
+    /* Clients with a scripted event to come, in a binary min-heap by time. */
+    size_t *events;
+    size_t n_events;
+
+    /* Clients that have connected but not been accepted yet, in order. Each
+     * client connects once, so the queue never wraps.
+     */
+    size_t *queue;
+    size_t queue_head;
+    size_t queue_tail;
+
+    /* Clients that may be readable. */
+    size_t *listed;
+    size_t n_listed;
+
+    /* Set to stop the server once there is nothing left to happen. */
+    volatile sig_atomic_t done;
+
+    /* Set while the server closes its remaining connections. */
+    bool shutting_down;
+
+    uint64_t rng;
+    struct stats stats;
+};
+
+
+static void usage(const char *name);
+static int parse_size(const char *arg, size_t *value);
+static int parse_double(const char *arg, double *value);
+static int parse_options(int argc, char **argv, struct options *opts);
+
+static uint64_t clock_ns(clockid_t clock);
+static uint64_t random_below(struct sim *sim, uint64_t n);
+
+static void push_event(struct sim *sim, size_t c);
+static size_t pop_event(struct sim *sim);
+static void schedule_next(struct sim *sim, size_t c);
+static void list_client(struct sim *sim, size_t c);
+static void run_event(struct sim *sim, size_t c);
+
+static uint64_t sim_now(void *ctx);
+static int sim_wait(void *ctx, struct pollfd *pfds, size_t n, uint64_t deadline, size_t *ready);
+static int sim_accept(void *ctx, int listener, size_t i);
+static ssize_t sim_recv(void *ctx, int handle, void *buf, size_t n);
+static ssize_t sim_send(void *ctx, int handle, const void *buf, size_t n);
+static void sim_close(void *ctx, int handle);
+
+static int initialise_sim(struct sim *sim, const struct options *opts);
+static void destroy_sim(struct sim *sim);
+static int report(const struct sim *sim, uint64_t wall, uint64_t cpu);
+
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-n CLIENTS] [-s SLOTS] [-d DURATION] [-t TIMEOUT] [-i INTERVAL] [-b BEATS] [-r SEED]\n", name);
+}
+
+
+static int parse_size(const char *arg, size_t *value) {
+    char *end;
+    unsigned long long n;
+
+    errno = 0;
+    n = strtoull(arg, &end, 10);
+
+    if (errno || end == arg || *end != '\0' || arg[0] == '-' || n > SIZE_MAX)
+        return 1;
+
+    *value = (size_t) n;
+    return 0;
+}
+
+
+static int parse_double(const char *arg, double *value) {
+    char *end;
+    double n;
+
+    errno = 0;
+    n = strtod(arg, &end);
+
+    if (errno || end == arg || *end != '\0' || !(n >= 0.0))
+        return 1;
+
+    *value = n;
+    return 0;
+}
+
+
+static int parse_options(int argc, char **argv, struct options *opts) {
+    int opt;
+    double timeout = TIMEOUT;
+
+    *opts = (struct options) {
+        .clients = CLIENTS,
+        .slots = SLOTS,
+        .duration = (uint64_t) (DURATION * 1e9),
+        .interval = (uint64_t) (INTERVAL * 1e9),
+        .beats = BEATS,
+        .seed = SEED
+    };
+
+    while ((opt = getopt(argc, argv, "n:s:d:t:i:b:r:")) != -1) {
+        size_t n;
+        double seconds;
+
+        switch (opt) {
+            case 'n':
+                /* Client handles are ints. */
+                if (parse_size(optarg, &opts->clients) || opts->clients == 0U || opts->clients >= (size_t) INT_MAX) {
+                    fprintf(stderr, "Invalid client count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+                if (parse_size(optarg, &opts->slots) || opts->slots < 2U) {
+                    fprintf(stderr, "Invalid slot count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'd':
+                if (parse_double(optarg, &seconds) || seconds < 1e-9 || seconds > 1e9) {
+                    fprintf(stderr, "Invalid duration '%s'\n", optarg);
+                    return 1;
+                }
+                opts->duration = (uint64_t) (seconds * 1e9);
+                break;
+            case 't':
+                if (parse_double(optarg, &timeout) || timeout < 1e-9 || timeout > (double) INT32_MAX) {
+                    fprintf(stderr, "Invalid timeout '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'i':
+                if (parse_double(optarg, &seconds) || seconds < 1e-9 || seconds > 1e9) {
+                    fprintf(stderr, "Invalid interval '%s'\n", optarg);
+                    return 1;
+                }
+                opts->interval = (uint64_t) (seconds * 1e9);
+                break;
+            case 'b':
+                if (parse_size(optarg, &opts->beats)) {
+                    fprintf(stderr, "Invalid heartbeat count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                if (parse_size(optarg, &n)) {
+                    fprintf(stderr, "Invalid seed '%s'\n", optarg);
+                    return 1;
+                }
+                opts->seed = (uint64_t) n;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind < argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    opts->timeout.tv_sec = (time_t) timeout;
+    opts->timeout.tv_nsec = (long) ((timeout - (double) opts->timeout.tv_sec) * 1e9);
+
+    /* Otherwise clients could time out between heartbeats. */
+    if ((double) opts->interval >= timeout * 1e9) {
+        fprintf(stderr, "Heartbeat interval must be shorter than the timeout\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static uint64_t clock_ns(clockid_t clock) {
+    struct timespec ts;
+
+    if (clock_gettime(clock, &ts)) {
+        perror("Failed to read the clock");
+        exit(EXIT_FAILURE);
+    }
+
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+
+static uint64_t random_below(struct sim *sim, uint64_t n) {
+    /* xorshift64*, which is plenty for scripting clients and the same on
+     * every platform.
+     */
+    sim->rng ^= sim->rng >> 12;
+    sim->rng ^= sim->rng << 25;
+    sim->rng ^= sim->rng >> 27;
+
+    return (sim->rng * UINT64_C(2685821657736338717)) % n;
+}
+
+
+static void push_event(struct sim *sim, size_t c) {
+    size_t k = sim->n_events++;
+
+    while (k > 0U) {
+        size_t parent = (k - 1U) / 2U;
+
+        if (sim->clients[sim->events[parent]].at <= sim->clients[c].at)
+            break;
+
+        sim->events[k] = sim->events[parent];
+        k = parent;
+    }
+
+    sim->events[k] = c;
+}
+
+
+static size_t pop_event(struct sim *sim) {
+    size_t top = sim->events[0];
+    size_t last = sim->events[--sim->n_events];
+    size_t k = 0U;
+
+    while (1) {
+        size_t child = 2U * k + 1U;
+
+        if (child >= sim->n_events)
+            break;
+
+        if (child + 1U < sim->n_events && sim->clients[sim->events[child + 1U]].at < sim->clients[sim->events[child]].at)
+            ++child;
+
+        if (sim->clients[last].at <= sim->clients[sim->events[child]].at)
+            break;
+
+        sim->events[k] = sim->events[child];
+        k = child;
+    }
+
+    sim->events[k] = last;
+    return top;
+}
+
+
+static void schedule_next(struct sim *sim, size_t c) {
+    struct client *client = &sim->clients[c];
+
+    /* A client out of heartbeats that does not close has gone silent. */
+    if (client->beats == 0U && !client->closes) {
+        client->at = UINT64_MAX;
+        return;
+    }
+
+    client->at = sim->now + 1U + random_below(sim, sim->opts->interval);
+    push_event(sim, c);
+}
+
+
+static void list_client(struct sim *sim, size_t c) {
+    struct client *client = &sim->clients[c];
+
+    if (client->listed)
+        return;
+
+    client->listed = true;
+    sim->listed[sim->n_listed++] = c;
+}
+
+
+static void run_event(struct sim *sim, size_t c) {
+    struct client *client = &sim->clients[c];
+
+    switch (client->state) {
+        case CLIENT_PENDING:
+            client->state = CLIENT_QUEUED;
+            sim->queue[sim->queue_tail++] = c;
+            schedule_next(sim, c);
+            break;
+        case CLIENT_QUEUED:
+        case CLIENT_CONNECTED:
+            if (client->beats > 0U) {
+                --client->beats;
+                ++client->unread;
+                ++sim->stats.frames;
+                schedule_next(sim, c);
+            } else {
+                client->eof = true;
+                client->at = UINT64_MAX;
+            }
+
+            list_client(sim, c);
+            break;
+        case CLIENT_REJECTED:
+        case CLIENT_DONE:
+            /* Closed by the server before the script finished. */
+            return;
+    }
+
+    ++sim->stats.events;
+}
+
+
+static uint64_t sim_now(void *ctx) {
+    const struct sim *sim = ctx;
+
+    return sim->now;
+}
+
+
+static int sim_wait(void *ctx, struct pollfd *pfds, size_t n, uint64_t deadline, size_t *ready) {
+    struct sim *sim = ctx;
+
+    (void) n;
+
+    while (1) {
+        size_t count = 0U;
+        uint64_t next;
+
+        if (sim->queue_head < sim->queue_tail && (pfds[0].events & POLLIN)) {
+            pfds[0].revents = POLLIN;
+            ready[count++] = 0U;
+        }
+
+        /* Readiness is level-triggered, as with poll(): a client stays ready
+         * until the server has read everything it sent.
+         */
+        for (size_t k = 0U; k < sim->n_listed;) {
+            size_t c = sim->listed[k];
+            struct client *client = &sim->clients[c];
+
+            if (client->state == CLIENT_CONNECTED && (client->unread > 0U || client->eof)) {
+                if (pfds[client->slot].events & POLLIN) {
+                    pfds[client->slot].revents = POLLIN;
+                    ready[count++] = client->slot;
+                }
+
+                ++k;
+            } else {
+                client->listed = false;
+                sim->listed[k] = sim->listed[--sim->n_listed];
+            }
+        }
+
+        if (count > 0U)
+            return (int) count;
+
+        /* Nothing is ready, so move time on to whichever comes first of the
+         * next scripted event and the next timer deadline.
+         */
+        next = sim->n_events > 0U ? sim->clients[sim->events[0]].at : UINT64_MAX;
+
+        if (next == UINT64_MAX && deadline == UINT64_MAX) {
+            sim->done = 1;
+            return 0;
+        }
+
+        if (deadline < next) {
+            if (deadline > sim->now)
+                sim->now = deadline;
+
+            return 0;
+        }
+
+        sim->now = next;
+
+        while (sim->n_events > 0U && sim->clients[sim->events[0]].at == sim->now)
+            run_event(sim, pop_event(sim));
+    }
+}
+
+
+static int sim_accept(void *ctx, int listener, size_t i) {
+    struct sim *sim = ctx;
+
+    size_t c;
+    struct client *client;
+
+    (void) listener;
+
+    if (sim->queue_head == sim->queue_tail) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    c = sim->queue[sim->queue_head++];
+    client = &sim->clients[c];
+
+    if (i == SIZE_MAX) {
+        client->state = CLIENT_REJECTED;
+        ++sim->stats.rejected;
+        return (int) c + 1;
+    }
+
+    /* The server arms the new connection's timer straight away. */
+    client->state = CLIENT_CONNECTED;
+    client->slot = i;
+    client->armed_at = sim->now;
+    ++sim->stats.accepted;
+
+    if (client->unread > 0U || client->eof)
+        list_client(sim, c);
+
+    return (int) c + 1;
+}
+
+
+static ssize_t sim_recv(void *ctx, int handle, void *buf, size_t n) {
+    struct sim *sim = ctx;
+    struct client *client = &sim->clients[handle - 1];
+
+    /* The server rearms the timer just before reading. */
+    client->armed_at = sim->now;
+
+    if (client->unread > 0U) {
+        size_t len = client->unread < n ? client->unread : n;
+
+        memset(buf, '\n', len);
+        client->unread -= len;
+        return (ssize_t) len;
+    }
+
+    if (client->eof)
+        return 0;
+
+    errno = EAGAIN;
+    return -1;
+}
+
+
+static ssize_t sim_send(void *ctx, int handle, const void *buf, size_t n) {
+    (void) ctx;
+    (void) handle;
+    (void) buf;
+    return (ssize_t) n;
+}
+
+
+static void sim_close(void *ctx, int handle) {
+    struct sim *sim = ctx;
+    struct client *client;
+
+    if (handle == LISTENER || sim->shutting_down)
+        return;
+
+    client = &sim->clients[handle - 1];
+
+    if (client->state == CLIENT_REJECTED) {
+        client->state = CLIENT_DONE;
+        return;
+    }
+
+    client->state = CLIENT_DONE;
+
+    if (client->eof) {
+        ++sim->stats.closed;
+        return;
+    }
+
+    /* The server closed the connection itself, which it should only do to a
+     * silent client, on the dot of its deadline.
+     */
+    ++sim->stats.events;
+
+    if (client->beats > 0U || client->closes || sim->now < client->armed_at + sim->timeout)
+        ++sim->stats.early;
+    else if (sim->now > client->armed_at + sim->timeout)
+        ++sim->stats.late;
+    else
+        ++sim->stats.timed_out;
+}
+
+
+static int initialise_sim(struct sim *sim, const struct options *opts) {
+    const size_t n = opts->clients;
+
+    *sim = (struct sim) {
+        .opts = opts,
+        .timeout = (uint64_t) opts->timeout.tv_sec * NSEC_PER_SEC + (uint64_t) opts->timeout.tv_nsec,
+        .rng = opts->seed ? opts->seed : SEED
+    };
+
+    sim->clients = calloc(n, sizeof(*sim->clients));
+    sim->events = malloc(n * sizeof(*sim->events));
+    sim->queue = malloc(n * sizeof(*sim->queue));
+    sim->listed = malloc(n * sizeof(*sim->listed));
+
+    if (!sim->clients || !sim->events || !sim->queue || !sim->listed) {
+        perror("Failed to allocate clients");
+        destroy_sim(sim);
+        return 1;
+    }
+
+    /* Script every client: when it connects, how many heartbeats it sends,
+     * and whether it then closes or goes silent.
+     */
+    for (size_t c = 0U; c < n; ++c) {
+        struct client *client = &sim->clients[c];
+
+        client->state = CLIENT_PENDING;
+        client->at = random_below(sim, opts->duration);
+        client->beats = (size_t) random_below(sim, (uint64_t) opts->beats + 1U);
+        client->closes = random_below(sim, 2U) == 0U;
+        push_event(sim, c);
+    }
+
+    return 0;
+}
+
+
+static void destroy_sim(struct sim *sim) {
+    free(sim->clients);
+    free(sim->events);
+    free(sim->queue);
+    free(sim->listed);
+}
+
+
+static int report(const struct sim *sim, uint64_t wall, uint64_t cpu) {
+    const struct stats *stats = &sim->stats;
+    const double virtual = (double) sim->now / 1e9;
+
+    printf("Simulated %zu clients over %.1f s of virtual time in %.3f s (%.0fx real time)\n",
+        sim->opts->clients, virtual, (double) wall / 1e9, wall > 0U ? virtual / ((double) wall / 1e9) : 0.0);
+    printf("Events: %ju, of which %ju heartbeats\n", stats->events, stats->frames);
+    printf("Connections: %ju accepted, %ju rejected, %ju closed by the client, %ju timed out\n",
+        stats->accepted, stats->rejected, stats->closed, stats->timed_out);
+    printf("CPU time: %.0f ns per event\n", stats->events > 0U ? (double) cpu / (double) stats->events : 0.0);
+    printf("Timeout errors: %ju early, %ju late, %ju missed\n", stats->early, stats->late, stats->missed);
+
+    return stats->early + stats->late + stats->missed > 0U;
+}
+
+
+int main(int argc, char **argv) {
+    struct options opts;
+    struct server_options server_opts;
+    struct sim sim;
+    struct server server;
+    struct timer_engine *timers;
+
+    struct server_backend backend = {
+        .now = sim_now,
+        .wait = sim_wait,
+        .accept = sim_accept,
+        .recv = sim_recv,
+        .send = sim_send,
+        .close = sim_close
+    };
+
+    uint64_t wall, cpu;
+    int failed;
+
+    if (parse_options(argc, argv, &opts))
+        return EXIT_FAILURE;
+
+    server_opts = (struct server_options) {
+        .max_connections = opts.slots,
+        .timeout = opts.timeout,
+        .timers = SERVER_TIMERS_HEAP
+    };
+
+    if (initialise_sim(&sim, &opts))
+        return EXIT_FAILURE;
+
+    backend.ctx = &sim;
+
+    /* POSIX timers expire in real time, so only the heap engine will do. */
+    timers = create_heap_engine(opts.slots, 0U);
+
+    if (!timers) {
+        destroy_sim(&sim);
+        return EXIT_FAILURE;
+    }
+
+    if (server_init(&server, &server_opts, &backend, NULL, timers, LISTENER, &sim.done)) {
+        timers->destroy(timers);
+        destroy_sim(&sim);
+        return EXIT_FAILURE;
+    }
+
+    server.log = NULL;
+
+    wall = clock_ns(CLOCK_MONOTONIC);
+    cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    event_loop(&server);
+    cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+    wall = clock_ns(CLOCK_MONOTONIC) - wall;
+
+    /* With nothing left to happen, every client should be gone. */
+    for (size_t c = 0U; c < opts.clients; ++c) {
+        if (sim.clients[c].state == CLIENT_QUEUED || sim.clients[c].state == CLIENT_CONNECTED)
+            ++sim.stats.missed;
+    }
+
+    sim.shutting_down = true;
+    server_shutdown(&server);
+    timers->destroy(timers);
+
+    failed = report(&sim, wall, cpu);
+    destroy_sim(&sim);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,604 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif
+
+#include "../timer.h"
+
+
+/* Default number of connections, each with its own timer. */
+static const size_t CONNECTIONS = 10000U;
+
+/* Default number of rounds, and of timers reset and left to expire in each.
+ * A round stands for one pass of the server's event loop.
+ */
+static const size_t ROUNDS = 100U;
+static const size_t RESETS = 1000U;
+static const size_t EXPIRIES = 10U;
+
+/* Timeout of timers that should not expire during the run, and of those that
+ * should expire straight away.
+ */
+static const time_t LONG_TIMEOUT = 3600;
+static const long SHORT_TIMEOUT_NS = 1000L;
+
+/* Time allowed for the short timers to expire before scanning for them. */
+static const long EXPIRY_WAIT_NS = 1000000L;
+
+/* Signal raised by expiring POSIX timers, as in the server. */
+static const int TIMEOUT_SIGNAL = SIGUSR1;
+
+static const uint64_t NSEC_PER_SEC = 1000000000U;
+
+
+/* A timeout engine under test. Each holds one timer per connection, indexed
+ * like the server's connection slots.
+ */
+struct backend {
+    const char *name;
+
+    /* Size of the engine's per-connection handle. Kernel-side objects, such
+     * as the POSIX timer itself or the file behind a timerfd, are not
+     * included.
+     */
+    size_t handle_size;
+
+    int (*create)(size_t n);
+    void (*destroy)(size_t n);
+    int (*arm)(size_t i, const struct timespec *timeout);
+    int (*disarm)(size_t i);
+    bool (*expired)(size_t i);
+
+    /* For an engine that finds its expired timers itself, rather than being
+     * asked about each connection in turn: the next timer to have expired,
+     * disarmed, or false once there are none left. NULL to scan with
+     * expired().
+     */
+    bool (*next_expired)(size_t *i);
+
+    /* For an engine whose handles are not one per connection: the bytes it
+     * allocated, for the handle size to be worked out from. NULL to report
+     * handle_size.
+     */
+    size_t (*memory)(void);
+};
+
+/* Run configuration, filled from the defaults above and the command line. */
+struct options {
+    size_t connections;
+    size_t rounds;
+    size_t resets;
+    size_t expiries;
+    const char *backend;
+};
+
+/* Time taken by each operation, summed over the run, and how many times it
+ * was done.
+ */
+struct result {
+    uint64_t create, arm, reset, scan, disarm, destroy;
+    uint64_t resets, scanned, expired, missed;
+    size_t handle_size;
+};
+
+
+/* Global flag to indicate that a timer has expired. */
+static volatile sig_atomic_t timeout_triggered = 0;
+
+static timer_t *posix_timers = NULL;
+
+static struct timer_engine *heap_engine = NULL;
+
+#ifdef __linux__
+static int *timerfds = NULL;
+#endif
+
+
+static void timeout_handler(int sig);
+static void usage(const char *name);
+static int parse_size(const char *arg, size_t *value);
+static int parse_options(int argc, char **argv, struct options *opts);
+
+static uint64_t now_ns(void);
+
+static int posix_create(size_t n);
+static void posix_destroy(size_t n);
+static int posix_arm(size_t i, const struct timespec *timeout);
+static int posix_disarm(size_t i);
+static bool posix_expired(size_t i);
+
+static int heap_create(size_t n);
+static void heap_destroy(size_t n);
+static int heap_arm(size_t i, const struct timespec *timeout);
+static int heap_disarm(size_t i);
+static bool heap_next_expired(size_t *i);
+static size_t heap_memory(void);
+
+#ifdef __linux__
+static int raise_file_limit(size_t n);
+static int timerfd_create_all(size_t n);
+static void timerfd_destroy_all(size_t n);
+static int timerfd_arm(size_t i, const struct timespec *timeout);
+static int timerfd_disarm(size_t i);
+static bool timerfd_expired(size_t i);
+#endif
+
+static int run_backend(const struct backend *backend, const struct options *opts, struct result *result);
+static void report(const struct backend *backend, const struct options *opts, const struct result *result);
+
+
+static const struct backend BACKENDS[] = {
+    {"posix", sizeof(timer_t), posix_create, posix_destroy, posix_arm, posix_disarm, posix_expired, NULL, NULL},
+    {"heap", 0U, heap_create, heap_destroy, heap_arm, heap_disarm, NULL, heap_next_expired, heap_memory},
+#ifdef __linux__
+    {"timerfd", sizeof(int), timerfd_create_all, timerfd_destroy_all, timerfd_arm, timerfd_disarm, timerfd_expired, NULL, NULL},
+#endif
+};
+
+
+static void timeout_handler(int sig) {
+    /* Avoid unused parameter warning. */
+    (void) sig;
+    timeout_triggered = 1;
+}
+
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-n CONNECTIONS] [-k ROUNDS] [-r RESETS] [-e EXPIRIES] [-b BACKEND]\n"
+        "\n"
+        "Backends:",
+        name);
+
+    for (size_t i = 0U; i < sizeof(BACKENDS) / sizeof(BACKENDS[0]); ++i)
+        fprintf(stderr, " %s", BACKENDS[i].name);
+
+    fprintf(stderr, " (default all)\n");
+}
+
+
+static int parse_size(const char *arg, size_t *value) {
+    char *end;
+    unsigned long long n;
+
+    errno = 0;
+    n = strtoull(arg, &end, 10);
+
+    if (errno || end == arg || *end != '\0' || arg[0] == '-' || n > SIZE_MAX)
+        return 1;
+
+    *value = (size_t) n;
+    return 0;
+}
+
+
+static int parse_options(int argc, char **argv, struct options *opts) {
+    int opt;
+
+    *opts = (struct options) {
+        .connections = CONNECTIONS,
+        .rounds = ROUNDS,
+        .resets = RESETS,
+        .expiries = EXPIRIES,
+        .backend = NULL
+    };
+
+    while ((opt = getopt(argc, argv, "n:k:r:e:b:")) != -1) {
+        switch (opt) {
+            case 'n':
+                if (parse_size(optarg, &opts->connections) || opts->connections == 0U) {
+                    fprintf(stderr, "Invalid connection count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'k':
+                if (parse_size(optarg, &opts->rounds) || opts->rounds == 0U) {
+                    fprintf(stderr, "Invalid round count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                if (parse_size(optarg, &opts->resets)) {
+                    fprintf(stderr, "Invalid reset count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'e':
+                if (parse_size(optarg, &opts->expiries)) {
+                    fprintf(stderr, "Invalid expiry count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'b':
+                opts->backend = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind < argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (opts->expiries > opts->connections) {
+        fprintf(stderr, "Cannot expire more timers per round than there are connections\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        perror("Failed to read the clock");
+        exit(EXIT_FAILURE);
+    }
+
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+
+static int posix_create(size_t n) {
+    posix_timers = calloc(n, sizeof(*posix_timers));
+
+    if (!posix_timers) {
+        perror("Failed to allocate timers");
+        return 1;
+    }
+
+    if (create_timers(posix_timers, n, TIMEOUT_SIGNAL)) {
+        free(posix_timers);
+        posix_timers = NULL;
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static void posix_destroy(size_t n) {
+    destroy_timers(posix_timers, n);
+    free(posix_timers);
+    posix_timers = NULL;
+}
+
+
+static int posix_arm(size_t i, const struct timespec *timeout) {
+    return arm_timer(posix_timers[i], timeout);
+}
+
+
+static int posix_disarm(size_t i) {
+    return disarm_timer(posix_timers[i]);
+}
+
+
+static bool posix_expired(size_t i) {
+    return timer_expired(posix_timers[i]);
+}
+
+
+/* The server's heap engine (timer.c), on the monotonic clock, as with
+ * sockets.
+ */
+static int heap_create(size_t n) {
+    heap_engine = create_heap_engine(n, 0U);
+
+    return heap_engine ? 0 : 1;
+}
+
+
+static void heap_destroy(size_t n) {
+    (void) n;
+
+    heap_engine->destroy(heap_engine);
+    heap_engine = NULL;
+}
+
+
+static int heap_arm(size_t i, const struct timespec *timeout) {
+    return heap_engine->arm(heap_engine, i, now_ns(), (uint64_t) timeout->tv_sec * NSEC_PER_SEC + (uint64_t) timeout->tv_nsec);
+}
+
+
+static int heap_disarm(size_t i) {
+    return heap_engine->disarm(heap_engine, i);
+}
+
+
+static bool heap_next_expired(size_t *i) {
+    return heap_engine->next_expired(heap_engine, now_ns(), i);
+}
+
+
+static size_t heap_memory(void) {
+    return heap_engine->memory;
+}
+
+
+#ifdef __linux__
+static int raise_file_limit(size_t n) {
+    /* Leave headroom for stdio. */
+    const rlim_t wanted = (rlim_t) n + 16U;
+
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit)) {
+        perror("Failed to get the file descriptor limit");
+        return 1;
+    }
+
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < wanted) {
+        limit.rlim_cur = (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < wanted) ? limit.rlim_max : wanted;
+
+        if (setrlimit(RLIMIT_NOFILE, &limit) || limit.rlim_cur < wanted) {
+            fprintf(stderr, "Failed to raise the file descriptor limit to %ju\n", (uintmax_t) wanted);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static int timerfd_create_all(size_t n) {
+    if (raise_file_limit(n))
+        return 1;
+
+    timerfds = malloc(n * sizeof(*timerfds));
+
+    if (!timerfds) {
+        perror("Failed to allocate timers");
+        return 1;
+    }
+
+    for (size_t i = 0U; i < n; ++i) {
+        timerfds[i] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+        if (timerfds[i] < 0) {
+            perror("Failed to create timerfd");
+            timerfd_destroy_all(i);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static void timerfd_destroy_all(size_t n) {
+    for (size_t i = 0U; i < n; ++i)
+        close(timerfds[i]);
+
+    free(timerfds);
+    timerfds = NULL;
+}
+
+
+static int timerfd_arm(size_t i, const struct timespec *timeout) {
+    struct itimerspec its = {
+        .it_value = *timeout
+    };
+
+    if (timerfd_settime(timerfds[i], 0, &its, NULL)) {
+        perror("Failed to arm timerfd");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static int timerfd_disarm(size_t i) {
+    struct itimerspec its = {0};
+
+    if (timerfd_settime(timerfds[i], 0, &its, NULL)) {
+        perror("Failed to disarm timerfd");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static bool timerfd_expired(size_t i) {
+    struct itimerspec its;
+
+    if (timerfd_gettime(timerfds[i], &its)) {
+        perror("Failed to get state of timerfd");
+        exit(EXIT_FAILURE);
+    }
+
+    return its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0;
+}
+#endif
+
+
+static int run_backend(const struct backend *backend, const struct options *opts, struct result *result) {
+    const size_t n = opts->connections;
+    const struct timespec long_timeout = {.tv_sec = LONG_TIMEOUT};
+    const struct timespec short_timeout = {.tv_nsec = SHORT_TIMEOUT_NS};
+    const struct timespec wait = {.tv_nsec = EXPIRY_WAIT_NS};
+
+    uint64_t start;
+    size_t next_expiry = 0U;
+
+    *result = (struct result) {0};
+
+    start = now_ns();
+    if (backend->create(n))
+        return 1;
+    result->create = now_ns() - start;
+
+    result->handle_size = backend->memory ? backend->memory() / n : backend->handle_size;
+
+    start = now_ns();
+    for (size_t i = 0U; i < n; ++i) {
+        if (backend->arm(i, &long_timeout)) {
+            backend->destroy(n);
+            return 1;
+        }
+    }
+    result->arm = now_ns() - start;
+
+    for (size_t round = 0U; round < opts->rounds; ++round) {
+        size_t found = 0U;
+
+        /* Activity on random connections, each pushing back its deadline. */
+        start = now_ns();
+        for (size_t j = 0U; j < opts->resets; ++j) {
+            if (backend->arm((size_t) random() % n, &long_timeout)) {
+                backend->destroy(n);
+                return 1;
+            }
+        }
+        result->reset += now_ns() - start;
+        result->resets += opts->resets;
+
+        /* Let a different set of connections time out each round. */
+        for (size_t j = 0U; j < opts->expiries; ++j) {
+            if (backend->arm((next_expiry + j) % n, &short_timeout)) {
+                backend->destroy(n);
+                return 1;
+            }
+        }
+
+        nanosleep(&wait, NULL);
+        timeout_triggered = 0;
+
+        /* The server's timeout check: every connection is looked at, or the
+         * engine gives up those that have expired, and those found expired
+         * are dealt with and their slots reused. Either way, the time is
+         * shared among all the connections.
+         */
+        start = now_ns();
+        if (backend->next_expired) {
+            size_t i;
+
+            while (backend->next_expired(&i)) {
+                ++found;
+
+                if (backend->arm(i, &long_timeout)) {
+                    backend->destroy(n);
+                    return 1;
+                }
+            }
+        } else {
+            for (size_t i = 0U; i < n; ++i) {
+                if (backend->expired(i)) {
+                    ++found;
+
+                    if (backend->arm(i, &long_timeout)) {
+                        backend->destroy(n);
+                        return 1;
+                    }
+                }
+            }
+        }
+        result->scan += now_ns() - start;
+        result->scanned += n;
+        result->expired += found;
+
+        if (found < opts->expiries)
+            result->missed += opts->expiries - found;
+
+        next_expiry = (next_expiry + opts->expiries) % n;
+    }
+
+    start = now_ns();
+    for (size_t i = 0U; i < n; ++i)
+        backend->disarm(i);
+    result->disarm = now_ns() - start;
+
+    start = now_ns();
+    backend->destroy(n);
+    result->destroy = now_ns() - start;
+
+    return 0;
+}
+
+
+static void report(const struct backend *backend, const struct options *opts, const struct result *result) {
+    const double n = (double) opts->connections;
+
+    printf("%-8s %9.0f %9.0f %9.0f %9.1f %9.0f %9.0f %8zu %9" PRIu64 " %7" PRIu64 "\n",
+        backend->name,
+        (double) result->create / n,
+        (double) result->arm / n,
+        result->resets > 0U ? (double) result->reset / (double) result->resets : 0.0,
+        (double) result->scan / (double) result->scanned,
+        (double) result->disarm / n,
+        (double) result->destroy / n,
+        result->handle_size,
+        result->expired,
+        result->missed);
+}
+
+
+int main(int argc, char **argv) {
+    struct options opts;
+    struct sigaction action = {
+        .sa_handler = timeout_handler
+    };
+
+    bool found = false;
+
+    if (parse_options(argc, argv, &opts))
+        return EXIT_FAILURE;
+
+    /* Expiring timers are delivered like they are to the server, so their
+     * signal handling is part of the cost.
+     */
+    if (sigemptyset(&action.sa_mask) || sigaction(TIMEOUT_SIGNAL, &action, NULL)) {
+        perror("Failed to install the timeout handler");
+        return EXIT_FAILURE;
+    }
+
+    srandom(1U);
+
+    printf("%zu connections, %zu rounds of %zu resets and %zu expiries, in ns per operation:\n",
+        opts.connections, opts.rounds, opts.resets, opts.expiries);
+    printf("%-8s %9s %9s %9s %9s %9s %9s %8s %9s %7s\n",
+        "backend", "create", "arm", "reset", "scan", "disarm", "destroy", "handle/B", "expired", "missed");
+
+    for (size_t i = 0U; i < sizeof(BACKENDS) / sizeof(BACKENDS[0]); ++i) {
+        struct result result;
+
+        if (opts.backend && strcmp(opts.backend, BACKENDS[i].name))
+            continue;
+
+        found = true;
+
+        if (run_backend(&BACKENDS[i], &opts, &result))
+            return EXIT_FAILURE;
+
+        report(&BACKENDS[i], &opts, &result);
+    }
+
+    if (!found) {
+        fprintf(stderr, "Unknown backend '%s'\n", opts.backend);
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,78 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+
+/* Traffic capture format, written by the server and replayed by the client.
+ *
+ * A capture file starts with the 8-byte CAPTURE_MAGIC, followed by a sequence
+ * of records. Each record is a CAPTURE_HEADER_SIZE-byte header followed by
+ * its payload. Header fields are big-endian:
+ *
+ *   Offset  Size  Field
+ *        0     8  Time since the start of the capture in nanoseconds
+ *        8     4  Connection slot (the server's client number)
+ *       12     1  Record type (enum capture_type)
+ *       13     3  Payload length in bytes
+ *
+ * Only CAPTURE_FRAME records have a payload: the content of one frame, without
+ * its terminating newline. A slot is only reused after a CAPTURE_CLOSE or
+ * CAPTURE_TIMEOUT record for it.
+ */
+
+enum {
+    CAPTURE_MAGIC_SIZE = 8,
+    CAPTURE_HEADER_SIZE = 16,
+    CAPTURE_MAX_PAYLOAD = 0xFFFFFF
+};
+
+enum capture_type {
+    CAPTURE_CONNECT = 1,
+    CAPTURE_FRAME = 2,
+    CAPTURE_CLOSE = 3,
+    CAPTURE_TIMEOUT = 4
+};
+
+struct capture_record {
+    uint64_t time;
+    uint32_t connection;
+    enum capture_type type;
+    uint32_t length;
+};
+
+
+static const char CAPTURE_MAGIC[CAPTURE_MAGIC_SIZE] = {'T', 'O', 'C', 'A', 'P', '0', '0', '1'};
+
+
+static inline void capture_encode(const struct capture_record *record, unsigned char *header) {
+    for (int i = 0; i < 8; ++i)
+        header[i] = (unsigned char) (record->time >> (56 - 8 * i));
+
+    for (int i = 0; i < 4; ++i)
+        header[8 + i] = (unsigned char) (record->connection >> (24 - 8 * i));
+
+    header[12] = (unsigned char) record->type;
+
+    for (int i = 0; i < 3; ++i)
+        header[13 + i] = (unsigned char) (record->length >> (16 - 8 * i));
+}
+
+
+static inline void capture_decode(const unsigned char *header, struct capture_record *record) {
+    record->time = 0U;
+    for (int i = 0; i < 8; ++i)
+        record->time = (record->time << 8) | header[i];
+
+    record->connection = 0U;
+    for (int i = 0; i < 4; ++i)
+        record->connection = (record->connection << 8) | header[8 + i];
+
+    record->type = (enum capture_type) header[12];
+
+    record->length = 0U;
+    for (int i = 0; i < 3; ++i)
+        record->length = (record->length << 8) | header[13 + i];
+}
+
+#endif
@@ -1,18 +1,32 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "capture.h"
+
 
 /* Size of the send buffer. */
 static const size_t BUFFER_SIZE = 1024U;
@@ -21,6 +35,229 @@ static const size_t BUFFER_SIZE = 1024U;
 static const char *ADDR = "127.0.0.1";
 static const uint16_t PORT = 1337U;
 
+/* Default number of concurrent connections opened in load mode. */
+static const size_t CONNECTIONS = 100U;
+
+/* Default per-connection send rate in frames per second (0 is unthrottled). */
+static const double RATE = 10.0;
+
+/* Default frame size in bytes, including the terminating newline. */
+static const size_t FRAME_SIZE = 64U;
+
+/* Default length of a load generation run in seconds. */
+static const time_t DURATION = 10;
+
+/* Server's client timeout in seconds, against which the idle mode measures
+ * when its connections get closed.
+ */
+static const double TIMEOUT = 30.0;
+
+/* Default number of frames sent on each connection in churn mode before it is
+ * closed.
+ */
+static const size_t FRAMES_PER_CONNECTION = 3U;
+
+/* Size of the blocks read from the input in streaming mode. */
+static const size_t STREAM_BLOCK_SIZE = 1024U * 1024U;
+
+/* Delay in seconds before reconnecting to the server after losing the
+ * connection, doubling with each failed attempt up to RECONNECT_MAX_DELAY.
+ */
+static const double RECONNECT_DELAY = 0.5;
+static const double RECONNECT_MAX_DELAY = 30.0;
+
+/* Keep-alive sent on otherwise quiet connections: an empty frame. */
+static const char HEARTBEAT[] = "\n";
+
+/* Interval between progress reports during a load generation run, in
+ * seconds.
+ */
+static const time_t REPORT_INTERVAL = 1;
+
+/* Maximum number of frames written to one connection before moving on to the
+ * next, so that an unthrottled or catching-up connection cannot starve the
+ * others.
+ */
+static const unsigned int SEND_BATCH = 64U;
+
+/* Maximum number of unacknowledged frames on one connection in ack mode. A
+ * connection that reaches it stops sending until the server catches up.
+ */
+static const size_t ACK_WINDOW = 1024U;
+
+/* Longest frame a capture can hold: the server hands on a frame that fills
+ * its receive buffer, of 1024 bytes with the null terminator, in pieces.
+ */
+static const uint32_t REPLAY_MAX_FRAME = 1023U;
+
+/* How far past the highest connection slot seen so far a capture's record
+ * may be. The server takes the lowest free slot, so a new one is only ever
+ * one past the highest.
+ */
+static const uint32_t REPLAY_MAX_SLOT_GAP = 1024U;
+
+static const uint64_t NSEC_PER_SEC = 1000000000U;
+
+
+/* Acknowledgements are the server's frame count as a big-endian 64-bit
+ * integer.
+ */
+enum {
+    ACK_SIZE = 8
+};
+
+/* Operating modes, selected with -m by the name at the same index of
+ * MODE_NAMES.
+ */
+enum mode {
+    MODE_INTERACTIVE,
+    MODE_LOAD,
+    MODE_IDLE,
+    MODE_CHURN,
+    MODE_STREAM,
+    MODE_SENDFILE,
+    MODE_REPLAY,
+    MODE_PINGPONG
+};
+
+static const char *const MODE_NAMES[] = {
+    "interactive",
+    "load",
+    "idle",
+    "churn",
+    "stream",
+    "sendfile",
+    "replay",
+    "pingpong"
+};
+
+/* Run configuration, filled from the defaults above and the command line. */
+struct options {
+    enum mode mode;
+    const char *addr;
+    uint16_t port;
+    size_t connections;
+    double rate;
+    size_t frame_size;
+    time_t duration;
+    bool open_loop;
+    double heartbeat;
+    double timeout;
+    size_t frames_per_connection;
+    const char *input;
+    double scale;
+    bool ack;
+};
+
+/* State of a single load-generating connection. */
+struct connection {
+    bool connected;
+
+    /* Set when the socket buffer filled up, in which case we wait for
+     * POLLOUT rather than the send schedule.
+     */
+    bool blocked;
+
+    /* Monotonic time (in nanoseconds) at which the next frame is due. */
+    uint64_t next_send;
+
+    /* Number of bytes of the current frame already written. */
+    size_t offset;
+
+    /* Monotonic times (in nanoseconds) at which the connection was
+     * established, last completed a frame, and was closed by the server.
+     */
+    uint64_t connected_at;
+    uint64_t last_sent;
+    uint64_t closed_at;
+
+    /* Time at which connect() was called, and the number of frames still to
+     * send before closing (churn mode).
+     */
+    uint64_t opened_at;
+    size_t frames_left;
+
+    /* Set while waiting for the echo of a ping, of which this many bytes
+     * have arrived (ping-pong mode).
+     */
+    bool awaiting;
+    size_t received;
+
+    /* In ack mode, the number of frames sent and acknowledged, the ring of
+     * ACK_WINDOW send times of the frames in between, and the
+     * acknowledgement being read along with how many of its bytes have
+     * arrived.
+     */
+    uint64_t sent;
+    uint64_t acked;
+    uint64_t *sent_at;
+    uint64_t ack;
+    size_t ack_len;
+};
+
+/* Running totals of a load generation run. */
+struct load_stats {
+    uint64_t frames;
+    uint64_t bytes;
+    size_t connected;
+    size_t failed;
+    size_t closed;
+
+    /* Connections opened, and connections that completed their frames and
+     * were closed by us (churn mode).
+     */
+    uint64_t attempts;
+    uint64_t cycles;
+
+    /* Frames acknowledged by the server (ack mode). */
+    uint64_t acked;
+};
+
+/* Latency histogram in the style of HdrHistogram. Values (in nanoseconds)
+ * below HISTOGRAM_SUB_BUCKETS are counted exactly; above that, each power of
+ * two range is split into HISTOGRAM_HALF_BUCKETS linear sub-buckets, which
+ * bounds the error of any recorded value to one part in
+ * HISTOGRAM_HALF_BUCKETS, under 2%, across the whole 64-bit range in a fixed
+ * 30 KiB of counters.
+ */
+enum {
+    HISTOGRAM_SUB_BUCKETS = 128,
+    HISTOGRAM_HALF_BUCKETS = HISTOGRAM_SUB_BUCKETS / 2,
+    HISTOGRAM_SIZE = HISTOGRAM_SUB_BUCKETS + (64 - 7) * HISTOGRAM_HALF_BUCKETS
+};
+
+struct histogram {
+    uint64_t counts[HISTOGRAM_SIZE];
+    uint64_t total;
+    uint64_t max;
+    double sum;
+};
+
+/* State shared by the connections of a load generation run. Sockets are held
+ * in the pollfd array (-1 denoting a closed slot), which runs parallel to the
+ * connection array.
+ */
+struct load {
+    const struct options *opts;
+    char *frame;
+
+    /* Time between frames on one connection in nanoseconds (0 when
+     * unthrottled).
+     */
+    uint64_t interval;
+
+    struct pollfd *pfds;
+    struct connection *conns;
+
+    /* Backing for every connection's ring of send times (ack mode). */
+    uint64_t *sent_at;
+
+    uint64_t start;
+    struct load_stats stats;
+    struct histogram latency;
+    struct histogram ack_latency;
+};
+
 
 /* Global flag to indicate that an interrupt signal has been delivered. */
 static volatile sig_atomic_t interrupt_triggered = 0;
@@ -29,8 +266,62 @@ static volatile sig_atomic_t interrupt_triggered = 0;
 static int initialise_signal_handler(void (*signal_handler)(int), int signal);
 static void interrupt_handler(int sig);
 
-static int initialise_connection(void);
+static void usage(const char *name);
+static int parse_size(const char *arg, size_t *value);
+static int parse_double(const char *arg, double *value);
+static int parse_options(int argc, char **argv, struct options *opts);
+
+static uint64_t now_ns(void);
+static int raise_file_limit(size_t n);
+
+static int resolve_address(const struct options *opts, struct sockaddr_in *addr);
+static int initialise_connection(const struct sockaddr_in *addr);
+static int open_connection(const struct sockaddr_in *addr);
 static int write_socket(int s, const void *buf, size_t n);
+static int write_vector(int s, struct iovec *iov, int n);
+static void cork_socket(int s, int cork);
+
+static uint64_t reconnect_delay(unsigned int failures);
+static uint64_t disconnect(int s, unsigned int *failures);
+static int send_lines(int s, char *input, size_t *n, uint64_t *last_sent);
+static int run_interactive(const struct options *opts, const struct sockaddr_in *addr);
+
+static size_t histogram_index(uint64_t value);
+static uint64_t histogram_value(size_t index);
+static void histogram_record(struct histogram *h, uint64_t value);
+static uint64_t histogram_percentile(const struct histogram *h, double percentile);
+static void report_latency(const struct histogram *h, const char *label);
+
+static int finish_connect(struct load *load, size_t i, uint64_t now);
+static int send_frames(struct load *load, size_t i, uint64_t now);
+static int drain_socket(int s);
+static int read_acks(struct load *load, size_t i, uint64_t now);
+static void drop_connection(struct load *load, size_t i);
+static void report_progress(const struct load *load, const struct load_stats *last, uint64_t elapsed, uint64_t period);
+static void report_timeouts(const struct load *load);
+static void report_load(const struct load *load, uint64_t elapsed);
+static struct load *create_load(const struct options *opts);
+static void destroy_load(struct load *load);
+static int run_load(const struct options *opts, const struct sockaddr_in *addr);
+
+static int send_churn_frames(struct load *load, size_t i);
+static void release_slot(struct load *load, size_t *free_slots, size_t *n_free, size_t i);
+static int run_churn(const struct options *opts, const struct sockaddr_in *addr);
+
+static int open_input(const struct options *opts);
+static int read_block(int fd, char *buf, size_t n, size_t *len);
+static uint64_t count_frames(const char *buf, size_t n);
+static int run_stream(const struct options *opts, const struct sockaddr_in *addr);
+
+static ssize_t send_file(int s, int fd, size_t *offset, size_t n);
+static int run_sendfile(const struct options *opts, const struct sockaddr_in *addr);
+
+static void sleep_until(uint64_t deadline);
+static int run_replay(const struct options *opts, const struct sockaddr_in *addr);
+
+static int send_ping(struct load *load, size_t i);
+static int read_pong(struct load *load, size_t i, uint64_t now);
+static int run_pingpong(const struct options *opts, const struct sockaddr_in *addr);
 
 
 static int initialise_signal_handler(void (*signal_handler)(int), int signal) {
@@ -60,28 +351,311 @@ static void interrupt_handler(int sig) {
 }
 
 
-static int initialise_connection(void) {
-    int s;
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [-m MODE] [-a ADDR] [-p PORT] [-c CONNECTIONS] [-r RATE]\n"
+        "          [-s FRAME_SIZE] [-d SECONDS] [-o] [-h HEARTBEAT] [-t TIMEOUT]\n"
+        "          [-f FRAMES] [-i FILE] [-x SCALE] [-k]\n"
+        "\n"
+        "Modes:\n"
+        "  interactive  Send lines read from stdin over one connection (default)\n"
+        "  load         Open many connections and send frames at a fixed rate\n"
+        "  idle         Open many silent connections and time the server closing them\n"
+        "  churn        Repeatedly connect, send a few frames and disconnect\n"
+        "  stream       Send the lines of a file (default stdin) as fast as possible\n"
+        "  sendfile     Send a file over and over on many connections, without copying\n"
+        "  replay       Replay a server traffic capture with its original timing\n"
+        "  pingpong     Send frames to an echoing server and time the round trips\n",
+        name);
+}
+
+
+static int parse_size(const char *arg, size_t *value) {
+    char *end;
+    unsigned long long n;
+
+    errno = 0;
+    n = strtoull(arg, &end, 10);
+
+    if (errno || end == arg || *end != '\0' || arg[0] == '-' || n > SIZE_MAX)
+        return 1;
+
+    *value = (size_t) n;
+    return 0;
+}
+
+
+static int parse_double(const char *arg, double *value) {
+    char *end;
+    double n;
+
+    errno = 0;
+    n = strtod(arg, &end);
+
+    if (errno || end == arg || *end != '\0' || !(n >= 0.0))
+        return 1;
+
+    *value = n;
+    return 0;
+}
+
+
+static int parse_options(int argc, char **argv, struct options *opts) {
+    int opt;
+
+    *opts = (struct options) {
+        .mode = MODE_INTERACTIVE,
+        .addr = ADDR,
+        .port = PORT,
+        .connections = CONNECTIONS,
+        .rate = RATE,
+        .frame_size = FRAME_SIZE,
+        .duration = 0,
+        .open_loop = false,
+        .heartbeat = -1.0,
+        .timeout = TIMEOUT,
+        .frames_per_connection = FRAMES_PER_CONNECTION,
+        .input = NULL,
+        .scale = 1.0,
+        .ack = false
+    };
+
+    while ((opt = getopt(argc, argv, "m:a:p:c:r:s:d:oh:t:f:i:x:k")) != -1) {
+        size_t n;
+
+        switch (opt) {
+            case 'm':
+                for (n = 0U; n < sizeof(MODE_NAMES) / sizeof(MODE_NAMES[0]); ++n) {
+                    if (!strcmp(optarg, MODE_NAMES[n]))
+                        break;
+                }
+
+                if (n == sizeof(MODE_NAMES) / sizeof(MODE_NAMES[0])) {
+                    fprintf(stderr, "Unknown mode '%s'\n", optarg);
+                    usage(argv[0]);
+                    return 1;
+                }
+
+                opts->mode = (enum mode) n;
+                break;
+            case 'a':
+                opts->addr = optarg;
+                break;
+            case 'p':
+                if (parse_size(optarg, &n) || n == 0U || n > UINT16_MAX) {
+                    fprintf(stderr, "Invalid port '%s'\n", optarg);
+                    return 1;
+                }
+                opts->port = (uint16_t) n;
+                break;
+            case 'c':
+                if (parse_size(optarg, &opts->connections) || opts->connections == 0U) {
+                    fprintf(stderr, "Invalid connection count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                if (parse_double(optarg, &opts->rate)) {
+                    fprintf(stderr, "Invalid rate '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 's':
+                if (parse_size(optarg, &opts->frame_size) || opts->frame_size == 0U) {
+                    fprintf(stderr, "Invalid frame size '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'd':
+                if (parse_size(optarg, &n) || n == 0U) {
+                    fprintf(stderr, "Invalid duration '%s'\n", optarg);
+                    return 1;
+                }
+                opts->duration = (time_t) n;
+                break;
+            case 'o':
+                opts->open_loop = true;
+                break;
+            case 'h':
+                if (parse_double(optarg, &opts->heartbeat)) {
+                    fprintf(stderr, "Invalid heartbeat interval '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 't':
+                if (parse_double(optarg, &opts->timeout) || opts->timeout == 0.0) {
+                    fprintf(stderr, "Invalid timeout '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'f':
+                if (parse_size(optarg, &opts->frames_per_connection)) {
+                    fprintf(stderr, "Invalid frame count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'i':
+                opts->input = strcmp(optarg, "-") ? optarg : NULL;
+                break;
+            case 'x':
+                if (parse_double(optarg, &opts->scale)) {
+                    fprintf(stderr, "Invalid time scale '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'k':
+                opts->ack = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind < argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (opts->open_loop && opts->rate == 0.0) {
+        fprintf(stderr, "An open-loop run needs a send rate\n");
+        return 1;
+    }
+
+    if (opts->ack && opts->mode != MODE_LOAD) {
+        fprintf(stderr, "Acknowledgements are only measured in load mode\n");
+        return 1;
+    }
+
+    /* Each ping waits for the last one's echo, so there is no timetable to
+     * keep to.
+     */
+    if (opts->open_loop && opts->mode == MODE_PINGPONG) {
+        fprintf(stderr, "Ping-pong mode is always closed-loop\n");
+        return 1;
+    }
+
+    /* Interactive sessions keep themselves alive by default, anything else
+     * has to ask for heartbeats.
+     */
+    if (opts->heartbeat < 0.0)
+        opts->heartbeat = opts->mode == MODE_INTERACTIVE ? opts->timeout / 2.0 : 0.0;
+
+    if (opts->mode == MODE_IDLE) {
+        /* Heartbeats are empty frames: a bare newline. */
+        opts->frame_size = sizeof(HEARTBEAT) - 1U;
+
+        /* By default, wait long enough for every silent connection to have
+         * timed out, with the same again to spare.
+         */
+        if (opts->duration == 0)
+            opts->duration = (time_t) (opts->timeout * 2.0) + 1;
+    }
+
+    if (opts->duration == 0)
+        opts->duration = DURATION;
+
+    return 0;
+}
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        perror("Failed to read the clock");
+        exit(EXIT_FAILURE);
+    }
+
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+
+static int raise_file_limit(size_t n) {
+    /* Leave headroom for stdio and anything else the process has open. */
+    const rlim_t wanted = (rlim_t) n + 16U;
+
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit)) {
+        perror("Failed to get the file descriptor limit");
+        return 1;
+    }
+
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < wanted) {
+        limit.rlim_cur = (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < wanted) ? limit.rlim_max : wanted;
+
+        if (setrlimit(RLIMIT_NOFILE, &limit)) {
+            perror("Failed to raise the file descriptor limit");
+            return 1;
+        }
+
+        if (limit.rlim_cur < wanted) {
+            fprintf(stderr, "File descriptor limit is %ju, some connections will fail\n", (uintmax_t) limit.rlim_cur);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
 
-    struct sockaddr_in addr = {
+static int resolve_address(const struct options *opts, struct sockaddr_in *addr) {
+    *addr = (struct sockaddr_in) {
         .sin_family = AF_INET,
-        .sin_port = htons(PORT)
+        .sin_port = htons(opts->port)
     };
 
-    s = socket(AF_INET, SOCK_STREAM, 0);
+    if (inet_pton(AF_INET, opts->addr, &addr->sin_addr.s_addr) != 1) {
+        fprintf(stderr, "Failed to parse address '%s'\n", opts->addr);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+static int initialise_connection(const struct sockaddr_in *addr) {
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (s < 0) {
+        perror("Failed to create socket");
+        return -1;
+    }
+
+    if (connect(s, (const struct sockaddr *) addr, (socklen_t) sizeof(*addr))) {
+        perror("Failed to connect with server");
+        close(s);
+        return -1;
+    }
+
+    return s;
+}
+
+
+static int open_connection(const struct sockaddr_in *addr) {
+    int flags;
+    int s = socket(AF_INET, SOCK_STREAM, 0);
 
     if (s < 0) {
         perror("Failed to create socket");
         return -1;
     }
 
-    if (inet_pton(AF_INET, ADDR, &addr.sin_addr.s_addr) != 1) {
-        perror("Failed to parse address");
+    /* Set the socket's O_NONBLOCK flag so the connect() completes in the
+     * event loop.
+     */
+    flags = fcntl(s, F_GETFL, 0);
+
+    if (flags == -1 || fcntl(s, F_SETFL, flags | O_NONBLOCK)) {
+        perror("Failed to set socket to nonblocking mode");
+        close(s);
         return -1;
     }
 
-    if (connect(s, (struct sockaddr *) &addr, (socklen_t) sizeof(addr))) {
+    if (connect(s, (const struct sockaddr *) addr, (socklen_t) sizeof(*addr)) && errno != EINPROGRESS) {
         perror("Failed to connect with server");
+        close(s);
         return -1;
     }
 
@@ -91,7 +665,7 @@ static int initialise_connection(void) {
 
 static int write_socket(int s, const void *buf, size_t n) {
     size_t sent = 0;
-    
+
     do {
         ssize_t ret = send(s, (const char *) buf + sent, n - sent, MSG_NOSIGNAL);
 
@@ -113,61 +687,1906 @@ static int write_socket(int s, const void *buf, size_t n) {
 }
 
 
-int main(void) {
-    int s;
-    int exit_status = EXIT_SUCCESS;
+static int write_vector(int s, struct iovec *iov, int n) {
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = (size_t) n
+    };
+
+    int flags = MSG_NOSIGNAL;
+
+#ifdef MSG_MORE
+    /* More data follows, so let the kernel hold back partial segments. */
+    flags |= MSG_MORE;
+#endif
+
+    while (msg.msg_iovlen > 0U) {
+        ssize_t ret = sendmsg(s, &msg, flags);
+
+        if (ret < 0) {
+            if (errno == EINTR && !interrupt_triggered)
+                continue;
+            else if (errno == ECONNRESET || errno == EPIPE)
+                fprintf(stderr, "Server disconnect\n");
+            else
+                perror("Failed to write to socket");
+
+            return 1;
+        }
+
+        /* Skip past whatever was written, which may end part way through a
+         * vector element.
+         */
+        while (msg.msg_iovlen > 0U && (size_t) ret >= msg.msg_iov->iov_len) {
+            ret -= (ssize_t) msg.msg_iov->iov_len;
+            ++msg.msg_iov;
+            --msg.msg_iovlen;
+        }
+
+        if (msg.msg_iovlen > 0U) {
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + ret;
+            msg.msg_iov->iov_len -= (size_t) ret;
+        }
+    }
+
+    return 0;
+}
+
+
+static void cork_socket(int s, int cork) {
+#ifdef TCP_CORK
+    /* Only send full segments until uncorked. Failure just costs
+     * throughput, so is not fatal.
+     */
+    if (setsockopt(s, IPPROTO_TCP, TCP_CORK, (const void *) &cork, (socklen_t) sizeof(cork)))
+        perror("Failed to set TCP_CORK");
+#else
+    (void) s;
+    (void) cork;
+#endif
+}
 
-    fprintf(stderr, "Enabling interrupt handler\n");
-    if (initialise_signal_handler(interrupt_handler, SIGINT))
-        return EXIT_FAILURE;
 
-    fprintf(stderr, "Connecting to server at %s:%" PRIu16 "\n", ADDR, PORT);
-    s = initialise_connection();
+static uint64_t reconnect_delay(unsigned int failures) {
+    double delay = RECONNECT_DELAY;
 
-    if (s < 0)
-        return EXIT_FAILURE;
+    while (failures-- > 0U && delay < RECONNECT_MAX_DELAY)
+        delay *= 2.0;
 
-    fprintf(stderr, "Connection initialised\n");
+    if (delay > RECONNECT_MAX_DELAY)
+        delay = RECONNECT_MAX_DELAY;
 
-    while (1) {
-        char buffer[BUFFER_SIZE];
+    /* Full jitter: wait anywhere up to the backoff delay, so clients cut off
+     * together by a server restart do not all come back in lockstep.
+     */
+    return (uint64_t) (delay * (double) random() / (double) RAND_MAX * (double) NSEC_PER_SEC);
+}
 
-        /* If an interrupt signal (Ctrl-C) is raised. */
-        if (interrupt_triggered)
+
+static uint64_t disconnect(int s, unsigned int *failures) {
+    uint64_t delay = reconnect_delay((*failures)++);
+
+    if (s >= 0)
+        close(s);
+
+    fprintf(stderr, "Reconnecting in %.1f s\n", (double) delay / (double) NSEC_PER_SEC);
+    return now_ns() + delay;
+}
+
+
+static int send_lines(int s, char *input, size_t *n, uint64_t *last_sent) {
+    char *start = input;
+    char *end = input + *n;
+    int ret = 0;
+
+    while (start < end) {
+        char *newline = memchr(start, '\n', (size_t) (end - start));
+        size_t len;
+
+        /* A partial line waits for the rest of it, unless it fills the whole
+         * buffer.
+         */
+        if (!newline && (start > input || *n < BUFFER_SIZE))
             break;
 
-        /* Input prompt. */
-        fprintf(stderr, "> ");
+        len = newline ? (size_t) (newline - start) + 1U : (size_t) (end - start);
 
-        if (!fgets(buffer, sizeof(buffer), stdin)) {
-            if (ferror(stdin)) {
-                if (errno == EINTR)
+        /* Skip the write() if the line is empty. The newline goes too, as
+         * that is what ends the frame at the server.
+         */
+        if (start[0] != '\n') {
+            if (write_socket(s, start, len)) {
+                ret = 1;
+                break;
+            }
+
+            *last_sent = now_ns();
+        }
+
+        start += len;
+    }
+
+    /* Whatever was not sent stays at the front of the buffer, to go out
+     * after a reconnection if need be.
+     */
+    *n = (size_t) (end - start);
+    memmove(input, start, *n);
+    return ret;
+}
+
+
+static int run_interactive(const struct options *opts, const struct sockaddr_in *addr) {
+    const uint64_t heartbeat = (uint64_t) (opts->heartbeat * (double) NSEC_PER_SEC);
+    const bool tty = isatty(STDIN_FILENO);
+
+    int s = -1;
+    int exit_status = 0;
+    bool eof = false;
+    unsigned int failures = 0U;
+    uint64_t last_sent = 0U, next_attempt = 0U;
+
+    char input[BUFFER_SIZE];
+    size_t n = 0U;
+
+    srandom((unsigned int) now_ns() ^ (unsigned int) getpid());
+
+    while (!interrupt_triggered) {
+        struct pollfd pfds[2];
+        uint64_t now = now_ns();
+        int timeout = -1;
+        int active;
+
+        if (s < 0 && now >= next_attempt) {
+            fprintf(stderr, "Connecting to server at %s:%" PRIu16 "\n", opts->addr, opts->port);
+            s = initialise_connection(addr);
+
+            if (s < 0) {
+                next_attempt = disconnect(s, &failures);
+                continue;
+            }
+
+            fprintf(stderr, "Connection initialised\n");
+            failures = 0U;
+            last_sent = now_ns();
+
+            /* Send whatever failed to go out before the disconnection. */
+            if (send_lines(s, input, &n, &last_sent)) {
+                next_attempt = disconnect(s, &failures);
+                s = -1;
+                continue;
+            }
+
+            if (tty && !eof)
+                fprintf(stderr, "> ");
+        }
+
+        if (s < 0) {
+            timeout = (int) ((next_attempt - now + 999999U) / 1000000U);
+        } else if (heartbeat > 0U) {
+            /* Only send a heartbeat if nothing else has been sent within the
+             * interval.
+             */
+            if (now >= last_sent + heartbeat) {
+                if (write_socket(s, HEARTBEAT, sizeof(HEARTBEAT) - 1U)) {
+                    next_attempt = disconnect(s, &failures);
+                    s = -1;
                     continue;
+                }
 
-                perror("Failed to read input");
-                exit_status = EXIT_FAILURE;
-                break;
+                last_sent = now = now_ns();
             }
 
-            /* End of file. */
-            clearerr(stdin);
-            continue;
+            timeout = (int) ((last_sent + heartbeat - now + 999999U) / 1000000U);
         }
 
-        /* Remove trailing newline, if exists, and skip the write() if of
-         * null length.
+        /* Input is only taken while connected, so nothing piles up while the
+         * server is away.
          */
-        buffer[strcspn(buffer, "\n")] = '\0';
-        if (strlen(buffer) == 0)
-            continue;
+        pfds[0].fd = (s >= 0 && !eof) ? STDIN_FILENO : -1;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = s;
+        pfds[1].events = POLLIN;
 
-        if (write_socket(s, buffer, strlen(buffer))) {
-            exit_status = EXIT_FAILURE;
+        /* Nothing left to send and nothing left to read. */
+        if (eof && n == 0U)
+            break;
+
+        active = poll(pfds, 2U, timeout);
+
+        if (active < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("Failed to poll");
+            exit_status = 1;
             break;
         }
-    }
 
-    fprintf(stderr, "Closing connection\n");
-    close(s);
-    return exit_status;
-}
\ No newline at end of file
+        /* Anything the server sends, acknowledgements (-k) or echoes (-e),
+         * is read and discarded, only its closing the connection or an error
+         * ending it. The socket blocks, so it is read once each time it
+         * becomes readable.
+         */
+        if (s >= 0 && pfds[1].revents) {
+            char discard[BUFFER_SIZE];
+            ssize_t ret = recv(s, discard, sizeof(discard), 0);
+
+            if (ret == 0 || (ret < 0 && errno != EINTR)) {
+                fprintf(stderr, "Server disconnect\n");
+                next_attempt = disconnect(s, &failures);
+                s = -1;
+                continue;
+            }
+        }
+
+        if (pfds[0].revents) {
+            ssize_t ret = read(STDIN_FILENO, input + n, sizeof(input) - n);
+
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+
+                perror("Failed to read input");
+                exit_status = 1;
+                break;
+            }
+
+            /* End of file. A terminal may carry on after a Ctrl-D, anything
+             * else is finished with.
+             */
+            if (ret == 0) {
+                if (!tty) {
+                    eof = true;
+
+                    /* Send the final line even without a newline. */
+                    if (n > 0U)
+                        input[n++] = '\n';
+                }
+            }
+
+            n += (size_t) ret;
+
+            if (send_lines(s, input, &n, &last_sent)) {
+                next_attempt = disconnect(s, &failures);
+                s = -1;
+                continue;
+            }
+
+            if (tty)
+                fprintf(stderr, "> ");
+        }
+    }
+
+    if (s >= 0) {
+        fprintf(stderr, "Closing connection\n");
+        close(s);
+    }
+
+    return exit_status;
+}
+
+
+static size_t histogram_index(uint64_t value) {
+    unsigned int exponent = 1U;
+
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return (size_t) value;
+
+    while ((value >> exponent) >= HISTOGRAM_SUB_BUCKETS)
+        ++exponent;
+
+    return HISTOGRAM_SUB_BUCKETS + (exponent - 1U) * HISTOGRAM_HALF_BUCKETS + (size_t) ((value >> exponent) - HISTOGRAM_HALF_BUCKETS);
+}
+
+
+static uint64_t histogram_value(size_t index) {
+    unsigned int exponent;
+    uint64_t mantissa;
+
+    if (index < HISTOGRAM_SUB_BUCKETS)
+        return (uint64_t) index;
+
+    exponent = (unsigned int) ((index - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_HALF_BUCKETS) + 1U;
+    mantissa = (uint64_t) ((index - HISTOGRAM_SUB_BUCKETS) % HISTOGRAM_HALF_BUCKETS) + HISTOGRAM_HALF_BUCKETS;
+
+    /* Report the highest value that shares the bucket. */
+    return ((mantissa + 1U) << exponent) - 1U;
+}
+
+
+static void histogram_record(struct histogram *h, uint64_t value) {
+    ++h->counts[histogram_index(value)];
+    ++h->total;
+    h->sum += (double) value;
+
+    if (value > h->max)
+        h->max = value;
+}
+
+
+static uint64_t histogram_percentile(const struct histogram *h, double percentile) {
+    const double target = percentile / 100.0 * (double) h->total;
+
+    uint64_t rank = (uint64_t) target;
+    uint64_t seen = 0U;
+
+    if ((double) rank < target || rank == 0U)
+        ++rank;
+
+    for (size_t i = 0U; i < HISTOGRAM_SIZE; ++i) {
+        seen += h->counts[i];
+
+        if (seen >= rank) {
+            uint64_t value = histogram_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+
+static void report_latency(const struct histogram *h, const char *label) {
+    static const double PERCENTILES[] = {50.0, 90.0, 99.0, 99.9, 99.99};
+
+    printf("Latency (%s), microseconds:\n", label);
+
+    if (h->total == 0U) {
+        printf("  no samples\n");
+        return;
+    }
+
+    printf("  mean %.1f", h->sum / (double) h->total / 1000.0);
+    for (size_t i = 0U; i < sizeof(PERCENTILES) / sizeof(PERCENTILES[0]); ++i)
+        printf(", p%g %.1f", PERCENTILES[i], (double) histogram_percentile(h, PERCENTILES[i]) / 1000.0);
+    printf(", max %.1f\n", (double) h->max / 1000.0);
+}
+
+
+static int finish_connect(struct load *load, size_t i, uint64_t now) {
+    int error = 0;
+    socklen_t len = (socklen_t) sizeof(error);
+
+    struct pollfd *pfd = &load->pfds[i];
+    struct connection *conn = &load->conns[i];
+
+    if (getsockopt(pfd->fd, SOL_SOCKET, SO_ERROR, &error, &len) || error) {
+        ++load->stats.failed;
+        close(pfd->fd);
+        pfd->fd = -1;
+        return 1;
+    }
+
+    conn->connected = true;
+    conn->connected_at = now;
+    pfd->events = POLLIN;
+    ++load->stats.connected;
+
+    /* An idle connection without heartbeats never sends anything. */
+    if (load->opts->mode == MODE_IDLE && load->interval == 0U) {
+        conn->next_send = UINT64_MAX;
+        return 0;
+    }
+
+    /* Spread the first frames across one send interval so the connections
+     * do not all fire in lockstep.
+     */
+    conn->next_send = now + load->interval / load->opts->connections * i;
+    return 0;
+}
+
+
+static int send_frames(struct load *load, size_t i, uint64_t now) {
+    const size_t size = load->opts->frame_size;
+
+    struct pollfd *pfd = &load->pfds[i];
+    struct connection *conn = &load->conns[i];
+
+    /* The ack window only ever fills in ack mode. */
+    for (unsigned int batch = 0U; batch < SEND_BATCH && conn->next_send <= now && conn->sent - conn->acked < ACK_WINDOW; ) {
+        ssize_t ret = send(pfd->fd, load->frame + conn->offset, size - conn->offset, MSG_NOSIGNAL);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            /* The socket buffer is full: wait for the server to catch up. */
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                conn->blocked = true;
+                pfd->events |= POLLOUT;
+                return 0;
+            }
+
+            return 1;
+        }
+
+        conn->offset += (size_t) ret;
+        load->stats.bytes += (uint64_t) ret;
+
+        if (conn->offset < size)
+            continue;
+
+        /* Frame complete: record how late it went out against the time it
+         * was scheduled for.
+         */
+        conn->last_sent = now_ns();
+        histogram_record(&load->latency, conn->last_sent - conn->next_send);
+        ++batch;
+
+        /* The round trip is timed from when the frame went out, or for an
+         * open-loop sender, from when it should have.
+         */
+        if (load->opts->ack)
+            conn->sent_at[conn->sent++ % ACK_WINDOW] = load->opts->open_loop ? conn->next_send : conn->last_sent;
+
+        conn->offset = 0U;
+        ++load->stats.frames;
+        conn->next_send += load->interval;
+
+        /* A closed-loop sender does not make up for time lost while blocked,
+         * which hides a server stall from its latency figures. An open-loop
+         * sender keeps to its timetable regardless, so every frame that
+         * should have gone out during the stall is counted as late.
+         */
+        if (!load->opts->open_loop && conn->next_send < now)
+            conn->next_send = now;
+    }
+
+    return 0;
+}
+
+
+static int drain_socket(int s) {
+    char buffer[BUFFER_SIZE];
+
+    while (1) {
+        ssize_t ret = recv(s, buffer, sizeof(buffer), 0);
+
+        if (ret > 0)
+            continue;
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        /* Nothing left to read is the only non-fatal outcome. */
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+
+        return 1;
+    }
+}
+
+
+static int read_acks(struct load *load, size_t i, uint64_t now) {
+    unsigned char buffer[BUFFER_SIZE];
+
+    struct connection *conn = &load->conns[i];
+
+    while (1) {
+        ssize_t ret = recv(load->pfds[i].fd, buffer, sizeof(buffer), 0);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            return 1;
+        }
+
+        if (ret == 0)
+            return 1;
+
+        for (size_t j = 0U; j < (size_t) ret; ++j) {
+            uint64_t acked;
+
+            conn->ack = (conn->ack << 8) | buffer[j];
+
+            if (++conn->ack_len < ACK_SIZE)
+                continue;
+
+            acked = conn->ack;
+            conn->ack = 0U;
+            conn->ack_len = 0U;
+
+            /* The server cannot have seen more frames than were sent. */
+            if (acked > conn->sent) {
+                fprintf(stderr, "Connection %zu acknowledged %" PRIu64 " of %" PRIu64 " frames sent\n", i, acked, conn->sent);
+                return 1;
+            }
+
+            /* An acknowledgement covers every frame up to the one it
+             * counts.
+             */
+            for (; conn->acked < acked; ++conn->acked) {
+                histogram_record(&load->ack_latency, now - conn->sent_at[conn->acked % ACK_WINDOW]);
+                ++load->stats.acked;
+            }
+        }
+    }
+}
+
+
+static void drop_connection(struct load *load, size_t i) {
+    ++load->stats.closed;
+    --load->stats.connected;
+    load->conns[i].closed_at = now_ns();
+    close(load->pfds[i].fd);
+    load->pfds[i].fd = -1;
+    load->conns[i].connected = false;
+}
+
+
+static void report_progress(const struct load *load, const struct load_stats *last, uint64_t elapsed, uint64_t period) {
+    const double seconds = (double) period / (double) NSEC_PER_SEC;
+    const struct load_stats *stats = &load->stats;
+
+    if (load->opts->mode == MODE_SENDFILE) {
+        fprintf(stderr, "[%6.1fs] %zu connected, %.2f MiB/s\n",
+            (double) elapsed / (double) NSEC_PER_SEC,
+            stats->connected,
+            (double) (stats->bytes - last->bytes) / seconds / (1024.0 * 1024.0));
+        return;
+    }
+
+    if (load->opts->mode == MODE_CHURN) {
+        fprintf(stderr, "[%6.1fs] %zu connected, %.0f connections/s, %.0f frames/s\n",
+            (double) elapsed / (double) NSEC_PER_SEC,
+            stats->connected,
+            (double) (stats->cycles - last->cycles) / seconds,
+            (double) (stats->frames - last->frames) / seconds);
+        return;
+    }
+
+    if (load->opts->ack) {
+        fprintf(stderr, "[%6.1fs] %zu connected, %.0f frames/s, %.0f acked/s, %.2f MiB/s\n",
+            (double) elapsed / (double) NSEC_PER_SEC,
+            stats->connected,
+            (double) (stats->frames - last->frames) / seconds,
+            (double) (stats->acked - last->acked) / seconds,
+            (double) (stats->bytes - last->bytes) / seconds / (1024.0 * 1024.0));
+        return;
+    }
+
+    fprintf(stderr, "[%6.1fs] %zu connected, %.0f frames/s, %.2f MiB/s\n",
+        (double) elapsed / (double) NSEC_PER_SEC,
+        stats->connected,
+        (double) (stats->frames - last->frames) / seconds,
+        (double) (stats->bytes - last->bytes) / seconds / (1024.0 * 1024.0));
+}
+
+
+static void report_timeouts(const struct load *load) {
+    const uint64_t timeout = (uint64_t) (load->opts->timeout * (double) NSEC_PER_SEC);
+
+    struct histogram late = {0};
+    size_t closed = 0U, early = 0U, open = 0U;
+    int64_t min_error = INT64_MAX, max_error = INT64_MIN;
+    double sum = 0.0;
+
+    printf("Timeout accuracy (deadline is last activity + %.3f s):\n", load->opts->timeout);
+    printf("  %10s %16s %16s %16s\n", "connection", "last activity/s", "closed/s", "error/ms");
+
+    for (size_t i = 0U; i < load->opts->connections; ++i) {
+        const struct connection *conn = &load->conns[i];
+        const uint64_t activity = conn->last_sent > conn->connected_at ? conn->last_sent : conn->connected_at;
+
+        int64_t error;
+
+        /* The connection was never established. */
+        if (conn->connected_at == 0U)
+            continue;
+
+        if (conn->closed_at == 0U) {
+            printf("  %10zu %16.3f %16s\n", i, (double) (activity - load->start) / (double) NSEC_PER_SEC, "open");
+            ++open;
+            continue;
+        }
+
+        error = (int64_t) (conn->closed_at - activity) - (int64_t) timeout;
+        printf("  %10zu %16.3f %16.3f %+16.3f\n", i,
+            (double) (activity - load->start) / (double) NSEC_PER_SEC,
+            (double) (conn->closed_at - load->start) / (double) NSEC_PER_SEC,
+            (double) error / 1e6);
+
+        ++closed;
+        sum += (double) error;
+
+        if (error < min_error)
+            min_error = error;
+        if (error > max_error)
+            max_error = error;
+
+        if (error < 0)
+            ++early;
+        else
+            histogram_record(&late, (uint64_t) error);
+    }
+
+    printf("Closed by server:  %zu (%zu before their deadline), %zu still open\n", closed, early, open);
+
+    if (closed > 0U) {
+        printf("Deadline error:    min %+.3f ms, mean %+.3f ms, max %+.3f ms\n",
+            (double) min_error / 1e6, sum / (double) closed / 1e6, (double) max_error / 1e6);
+        report_latency(&late, "closed after deadline, deadline to close");
+    }
+}
+
+
+static void report_load(const struct load *load, uint64_t elapsed) {
+    const double seconds = (double) elapsed / (double) NSEC_PER_SEC;
+    const struct options *opts = load->opts;
+    const struct load_stats *stats = &load->stats;
+
+    printf("Duration:          %.3f s\n", seconds);
+
+    if (opts->mode == MODE_CHURN) {
+        size_t connecting = 0U;
+
+        /* A connect() stuck at the end of the run has no latency sample, so
+         * at least say how many there were.
+         */
+        for (size_t i = 0U; i < opts->connections; ++i) {
+            if (load->pfds[i].fd >= 0 && !load->conns[i].connected)
+                ++connecting;
+        }
+
+        printf("Connections:       %" PRIu64 " opened, %" PRIu64 " completed, %zu failed, %zu closed early by server, %zu still connecting\n",
+            stats->attempts, stats->cycles, stats->failed, stats->closed, connecting);
+        printf("Churn rate:        %.0f connections/s", (double) stats->cycles / seconds);
+
+        if (opts->rate > 0.0)
+            printf(" (target %.0f)", opts->rate);
+
+        printf("\n");
+        printf("Frames sent:       %" PRIu64 " (%zu bytes each)\n", stats->frames, opts->frame_size);
+        report_latency(&load->latency, "connect() to established");
+        return;
+    }
+
+    printf("Connections:       %zu requested, %zu open, %zu failed, %zu closed by server\n",
+        opts->connections, stats->connected, stats->failed, stats->closed);
+
+    /* Frames are only counted for whole passes through the file. */
+    if (opts->mode == MODE_SENDFILE)
+        printf("Frames sent:       %" PRIu64 "\n", stats->frames);
+    else
+        printf("Frames sent:       %" PRIu64 " (%zu bytes each)\n", stats->frames, opts->frame_size);
+
+    printf("Bytes sent:        %" PRIu64 "\n", stats->bytes);
+    printf("Throughput:        %.0f frames/s, %.2f MiB/s\n",
+        (double) stats->frames / seconds,
+        (double) stats->bytes / seconds / (1024.0 * 1024.0));
+
+    if (opts->mode == MODE_IDLE) {
+        report_timeouts(load);
+        return;
+    }
+
+    if (opts->mode == MODE_SENDFILE)
+        return;
+
+    if (opts->mode == MODE_PINGPONG) {
+        printf("Round trips:       %" PRIu64 "\n", load->latency.total);
+        report_latency(&load->latency, "first byte sent to last byte echoed");
+        return;
+    }
+
+    /* Without a timetable there is nothing to be late against. */
+    if (load->interval > 0U)
+        report_latency(&load->latency, opts->open_loop ? "open-loop, scheduled to written" : "closed-loop, scheduled to written");
+
+    if (opts->ack) {
+        printf("Frames acked:      %" PRIu64 "\n", stats->acked);
+        report_latency(&load->ack_latency, opts->open_loop ? "open-loop, scheduled to acknowledged" : "closed-loop, written to acknowledged");
+    }
+}
+
+
+static struct load *create_load(const struct options *opts) {
+    const size_t n = opts->connections;
+
+    struct load *load = calloc(1U, sizeof(*load));
+
+    if (!load) {
+        perror("Failed to allocate the load generator");
+        return NULL;
+    }
+
+    load->opts = opts;
+
+    /* The interval is between heartbeats in idle mode, and between
+     * connection attempts in churn mode.
+     */
+    if (opts->mode == MODE_IDLE)
+        load->interval = (uint64_t) (opts->heartbeat * (double) NSEC_PER_SEC);
+    else
+        load->interval = opts->rate > 0.0 ? (uint64_t) ((double) NSEC_PER_SEC / opts->rate) : 0U;
+
+    load->frame = malloc(opts->frame_size);
+    load->pfds = calloc(n, sizeof(*load->pfds));
+    load->conns = calloc(n, sizeof(*load->conns));
+
+    if (!load->frame || !load->pfds || !load->conns) {
+        perror("Failed to allocate the connection table");
+        destroy_load(load);
+        return NULL;
+    }
+
+    if (opts->ack) {
+        load->sent_at = malloc(n * ACK_WINDOW * sizeof(*load->sent_at));
+
+        if (!load->sent_at) {
+            perror("Failed to allocate the acknowledgement windows");
+            destroy_load(load);
+            return NULL;
+        }
+
+        for (size_t i = 0U; i < n; ++i)
+            load->conns[i].sent_at = load->sent_at + i * ACK_WINDOW;
+    }
+
+    /* Every frame carries the same filler payload terminated by a newline. */
+    memset(load->frame, 'x', opts->frame_size - 1U);
+    load->frame[opts->frame_size - 1U] = '\n';
+
+    for (size_t i = 0U; i < n; ++i)
+        load->pfds[i].fd = -1;
+
+    raise_file_limit(n);
+    return load;
+}
+
+
+static void destroy_load(struct load *load) {
+    if (load->pfds) {
+        for (size_t i = 0U; i < load->opts->connections; ++i) {
+            if (load->pfds[i].fd >= 0)
+                close(load->pfds[i].fd);
+        }
+    }
+
+    free(load->frame);
+    free(load->pfds);
+    free(load->conns);
+    free(load->sent_at);
+    free(load);
+}
+
+
+static int run_load(const struct options *opts, const struct sockaddr_in *addr) {
+    const size_t n = opts->connections;
+    const uint64_t report_period = (uint64_t) REPORT_INTERVAL * NSEC_PER_SEC;
+
+    struct load_stats last = {0};
+    uint64_t start, end, next_report, now;
+
+    struct load *load = create_load(opts);
+
+    if (!load)
+        return 1;
+
+    fprintf(stderr, "Opening %zu connections to %s:%" PRIu16 "\n", n, opts->addr, opts->port);
+    for (size_t i = 0U; i < n; ++i) {
+        load->pfds[i].fd = open_connection(addr);
+        load->pfds[i].events = POLLOUT;
+
+        if (load->pfds[i].fd < 0)
+            ++load->stats.failed;
+    }
+
+    start = load->start = now_ns();
+    end = start + (uint64_t) opts->duration * NSEC_PER_SEC;
+    next_report = start + report_period;
+
+    while (!interrupt_triggered) {
+        uint64_t wake;
+        int active;
+
+        now = now_ns();
+
+        /* Stop once the time is up or there are no connections left. */
+        if (now >= end || load->stats.failed + load->stats.closed == n)
+            break;
+
+        if (now >= next_report) {
+            report_progress(load, &last, now - start, report_period);
+            last = load->stats;
+            next_report += report_period;
+        }
+
+        wake = next_report < end ? next_report : end;
+
+        /* Write every frame that has fallen due, and find out when the next
+         * one will be.
+         */
+        for (size_t i = 0U; i < n; ++i) {
+            struct connection *conn = &load->conns[i];
+
+            if (load->pfds[i].fd < 0 || !conn->connected || conn->blocked)
+                continue;
+
+            if (send_frames(load, i, now)) {
+                drop_connection(load, i);
+                continue;
+            }
+
+            /* A connection with a full ack window waits for an
+             * acknowledgement instead.
+             */
+            if (!conn->blocked && conn->next_send < wake && conn->sent - conn->acked < ACK_WINDOW)
+                wake = conn->next_send;
+        }
+
+        /* Round the wait up to whole milliseconds so we never wake early. */
+        active = poll(load->pfds, (nfds_t) n, wake > now ? (int) ((wake - now + 999999U) / 1000000U) : 0);
+
+        if (active < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("Failed to poll sockets");
+            break;
+        }
+
+        now = now_ns();
+
+        for (size_t i = 0U; i < n && active > 0; ++i) {
+            struct pollfd *pfd = &load->pfds[i];
+            struct connection *conn = &load->conns[i];
+
+            if (pfd->fd < 0 || !pfd->revents)
+                continue;
+
+            --active;
+
+            if (!conn->connected) {
+                finish_connect(load, i, now);
+                continue;
+            }
+
+            if (pfd->revents & (POLLIN | POLLERR | POLLHUP)) {
+                if (opts->ack ? read_acks(load, i, now) : drain_socket(pfd->fd)) {
+                    drop_connection(load, i);
+                    continue;
+                }
+            }
+
+            if (pfd->revents & POLLOUT) {
+                conn->blocked = false;
+                pfd->events &= (short) ~POLLOUT;
+            }
+        }
+    }
+
+    report_load(load, now_ns() - start);
+    destroy_load(load);
+    return 0;
+}
+
+
+static int send_churn_frames(struct load *load, size_t i) {
+    const size_t size = load->opts->frame_size;
+
+    struct pollfd *pfd = &load->pfds[i];
+    struct connection *conn = &load->conns[i];
+
+    while (conn->frames_left > 0U) {
+        ssize_t ret = send(pfd->fd, load->frame + conn->offset, size - conn->offset, MSG_NOSIGNAL);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                pfd->events |= POLLOUT;
+                return 0;
+            }
+
+            return 1;
+        }
+
+        conn->offset += (size_t) ret;
+        load->stats.bytes += (uint64_t) ret;
+
+        if (conn->offset < size)
+            continue;
+
+        conn->offset = 0U;
+        --conn->frames_left;
+        ++load->stats.frames;
+    }
+
+    return 0;
+}
+
+
+static void release_slot(struct load *load, size_t *free_slots, size_t *n_free, size_t i) {
+    if (load->conns[i].connected)
+        --load->stats.connected;
+
+    close(load->pfds[i].fd);
+    load->pfds[i].fd = -1;
+    load->conns[i].connected = false;
+    free_slots[(*n_free)++] = i;
+}
+
+
+static int run_churn(const struct options *opts, const struct sockaddr_in *addr) {
+    const size_t n = opts->connections;
+    const uint64_t report_period = (uint64_t) REPORT_INTERVAL * NSEC_PER_SEC;
+
+    struct load_stats last = {0};
+    uint64_t start, end, next_report, next_open, now;
+    size_t n_free = n;
+
+    struct load *load;
+    size_t *free_slots = malloc(n * sizeof(*free_slots));
+
+    if (!free_slots) {
+        perror("Failed to allocate the connection table");
+        return 1;
+    }
+
+    load = create_load(opts);
+
+    if (!load) {
+        free(free_slots);
+        return 1;
+    }
+
+    /* Stack of unused slots, so finding one is constant time however many
+     * there are.
+     */
+    for (size_t i = 0U; i < n; ++i)
+        free_slots[i] = n - 1U - i;
+
+    fprintf(stderr, "Churning up to %zu concurrent connections to %s:%" PRIu16 "\n", n, opts->addr, opts->port);
+
+    start = load->start = now_ns();
+    end = start + (uint64_t) opts->duration * NSEC_PER_SEC;
+    next_report = start + report_period;
+    next_open = start;
+
+    while (!interrupt_triggered) {
+        uint64_t wake;
+        int active;
+
+        now = now_ns();
+
+        if (now >= end)
+            break;
+
+        if (now >= next_report) {
+            report_progress(load, &last, now - start, report_period);
+            last = load->stats;
+            next_report += report_period;
+        }
+
+        /* Open new connections as they fall due, for as long as there are
+         * free slots.
+         */
+        while (n_free > 0U && next_open <= now) {
+            size_t i = free_slots[--n_free];
+
+            load->conns[i] = (struct connection) {
+                .opened_at = now,
+                .frames_left = opts->frames_per_connection
+            };
+
+            load->pfds[i].fd = open_connection(addr);
+            load->pfds[i].events = POLLOUT;
+            ++load->stats.attempts;
+            next_open += load->interval;
+
+            if (load->pfds[i].fd < 0) {
+                ++load->stats.failed;
+                free_slots[n_free++] = i;
+                break;
+            }
+        }
+
+        /* Like the load mode this is closed-loop: time spent with every slot
+         * busy is not made up for with a burst of connections.
+         */
+        if (n_free == 0U && next_open < now)
+            next_open = now;
+
+        wake = next_report < end ? next_report : end;
+
+        if (n_free > 0U && next_open < wake)
+            wake = next_open;
+
+        /* Round the wait up to whole milliseconds so we never wake early. */
+        active = poll(load->pfds, (nfds_t) n, wake > now ? (int) ((wake - now + 999999U) / 1000000U) : 0);
+
+        if (active < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("Failed to poll sockets");
+            break;
+        }
+
+        now = now_ns();
+
+        for (size_t i = 0U; i < n && active > 0; ++i) {
+            struct pollfd *pfd = &load->pfds[i];
+            struct connection *conn = &load->conns[i];
+
+            if (pfd->fd < 0 || !pfd->revents)
+                continue;
+
+            --active;
+
+            if (!conn->connected) {
+                int error = 0;
+                socklen_t len = (socklen_t) sizeof(error);
+
+                if (getsockopt(pfd->fd, SOL_SOCKET, SO_ERROR, &error, &len) || error) {
+                    ++load->stats.failed;
+                    release_slot(load, free_slots, &n_free, i);
+                    continue;
+                }
+
+                conn->connected = true;
+                pfd->events = POLLIN;
+                ++load->stats.connected;
+                histogram_record(&load->latency, now - conn->opened_at);
+            } else if ((pfd->revents & (POLLIN | POLLERR | POLLHUP)) && drain_socket(pfd->fd)) {
+                ++load->stats.closed;
+                release_slot(load, free_slots, &n_free, i);
+                continue;
+            }
+
+            /* A newly established connection is writable straight away. */
+            if (pfd->revents & POLLOUT) {
+                pfd->events &= (short) ~POLLOUT;
+
+                if (send_churn_frames(load, i)) {
+                    ++load->stats.closed;
+                    release_slot(load, free_slots, &n_free, i);
+                    continue;
+                }
+
+                if (conn->frames_left == 0U) {
+                    ++load->stats.cycles;
+                    release_slot(load, free_slots, &n_free, i);
+                }
+            }
+        }
+    }
+
+    report_load(load, now_ns() - start);
+    destroy_load(load);
+    free(free_slots);
+    return 0;
+}
+
+
+static int open_input(const struct options *opts) {
+    int fd;
+
+    if (!opts->input)
+        return STDIN_FILENO;
+
+    fd = open(opts->input, O_RDONLY);
+
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open '%s'", opts->input);
+        perror(NULL);
+    }
+
+    return fd;
+}
+
+
+static int read_block(int fd, char *buf, size_t n, size_t *len) {
+    *len = 0U;
+
+    /* Keep reading until the block is full or the input ends: reads from a
+     * pipe return no more than the pipe's buffer at a time.
+     */
+    while (*len < n && !interrupt_triggered) {
+        ssize_t ret = read(fd, buf + *len, n - *len);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("Failed to read input");
+            return 1;
+        }
+
+        if (ret == 0)
+            break;
+
+        *len += (size_t) ret;
+    }
+
+    return 0;
+}
+
+
+static uint64_t count_frames(const char *buf, size_t n) {
+    uint64_t frames = 0U;
+    const char *end = buf + n;
+
+    while ((buf = memchr(buf, '\n', (size_t) (end - buf)))) {
+        ++frames;
+        ++buf;
+    }
+
+    return frames;
+}
+
+
+static int run_stream(const struct options *opts, const struct sockaddr_in *addr) {
+    int in, s;
+    int exit_status = 0;
+    char last = '\n';
+    size_t carried = 0U;
+    uint64_t frames = 0U, bytes = 0U, start;
+    double seconds;
+
+    char *block = malloc(STREAM_BLOCK_SIZE);
+    char *carry = malloc(STREAM_BLOCK_SIZE);
+
+    if (!block || !carry) {
+        perror("Failed to allocate the stream buffers");
+        free(block);
+        free(carry);
+        return 1;
+    }
+
+    in = open_input(opts);
+
+    if (in < 0) {
+        free(block);
+        free(carry);
+        return 1;
+    }
+
+    fprintf(stderr, "Connecting to server at %s:%" PRIu16 "\n", opts->addr, opts->port);
+    s = initialise_connection(addr);
+
+    if (s < 0) {
+        if (in != STDIN_FILENO)
+            close(in);
+
+        free(block);
+        free(carry);
+        return 1;
+    }
+
+    cork_socket(s, 1);
+    start = now_ns();
+
+    while (!interrupt_triggered) {
+        struct iovec iov[2];
+        size_t len, end;
+        bool eof;
+
+        if (read_block(in, block, STREAM_BLOCK_SIZE, &len)) {
+            exit_status = 1;
+            break;
+        }
+
+        eof = len < STREAM_BLOCK_SIZE;
+
+        if (len > 0U)
+            last = block[len - 1U];
+
+        frames += count_frames(block, len);
+
+        /* Only whole lines are written, so each write carries complete
+         * frames. The partial line at the end of the block is carried over
+         * and sent with the next one, from its own buffer to save moving the
+         * block around.
+         */
+        for (end = len; end > 0U && block[end - 1U] != '\n'; --end)
+            ;
+
+        /* There is no line to finish at the end of the input, nor any point
+         * holding back a line longer than the carry buffer.
+         */
+        if (eof || (end == 0U && carried + len > STREAM_BLOCK_SIZE))
+            end = len;
+
+        /* At the end of the input, even an empty block is written, to flush
+         * what was carried over, as there is no next one to send it with.
+         */
+        if (end == 0U && !eof) {
+            memcpy(carry + carried, block, len);
+            carried += len;
+            continue;
+        }
+
+        iov[0] = (struct iovec) {.iov_base = carry, .iov_len = carried};
+        iov[1] = (struct iovec) {.iov_base = block, .iov_len = end};
+
+        if (write_vector(s, iov, 2)) {
+            exit_status = 1;
+            break;
+        }
+
+        bytes += carried + end;
+        carried = len - end;
+        memcpy(carry, block + end, carried);
+
+        if (eof)
+            break;
+    }
+
+    /* Terminate the final line, so it is not left as a partial frame. */
+    if (!exit_status && !interrupt_triggered && last != '\n') {
+        if (write_socket(s, "\n", 1U)) {
+            exit_status = 1;
+        } else {
+            ++frames;
+            ++bytes;
+        }
+    }
+
+    /* Uncorking flushes anything still held back. */
+    cork_socket(s, 0);
+    seconds = (double) (now_ns() - start) / (double) NSEC_PER_SEC;
+
+    printf("Duration:          %.3f s\n", seconds);
+    printf("Frames sent:       %" PRIu64 "\n", frames);
+    printf("Bytes sent:        %" PRIu64 "\n", bytes);
+    printf("Throughput:        %.0f frames/s, %.2f MiB/s\n",
+        (double) frames / seconds,
+        (double) bytes / seconds / (1024.0 * 1024.0));
+
+    fprintf(stderr, "Closing connection\n");
+    close(s);
+
+    if (in != STDIN_FILENO)
+        close(in);
+
+    free(block);
+    free(carry);
+    return exit_status;
+}
+
+
+static ssize_t send_file(int s, int fd, size_t *offset, size_t n) {
+#ifdef __linux__
+    /* Straight from the page cache to the socket, without a copy through
+     * userspace.
+     */
+    off_t off = (off_t) *offset;
+    ssize_t ret = sendfile(s, fd, &off, n);
+
+    if (ret > 0)
+        *offset = (size_t) off;
+
+    return ret;
+#else
+    /* Without a portable sendfile(), fall back to copying. */
+    char buffer[BUFFER_SIZE];
+    ssize_t ret = pread(fd, buffer, n < sizeof(buffer) ? n : sizeof(buffer), (off_t) *offset);
+
+    if (ret <= 0)
+        return ret;
+
+    ret = send(s, buffer, (size_t) ret, MSG_NOSIGNAL);
+
+    if (ret > 0)
+        *offset += (size_t) ret;
+
+    return ret;
+#endif
+}
+
+
+static int run_sendfile(const struct options *opts, const struct sockaddr_in *addr) {
+    const size_t n = opts->connections;
+    const uint64_t report_period = (uint64_t) REPORT_INTERVAL * NSEC_PER_SEC;
+
+    struct load_stats last = {0};
+    struct sigaction ignore = {
+        .sa_handler = SIG_IGN
+    };
+
+    struct stat st;
+    uint64_t start, end, next_report, now;
+    uint64_t file_frames = 0U, passes = 0U;
+    size_t size;
+    int in;
+
+    struct load *load;
+
+    if (!opts->input) {
+        fprintf(stderr, "Sendfile mode needs an input file\n");
+        return 1;
+    }
+
+    in = open_input(opts);
+
+    if (in < 0)
+        return 1;
+
+    if (fstat(in, &st) || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        fprintf(stderr, "'%s' is not a non-empty regular file\n", opts->input);
+        close(in);
+        return 1;
+    }
+
+    size = (size_t) st.st_size;
+
+    /* Count the frames in the file, which also pulls it into the page cache
+     * before the clock starts.
+     */
+    while (1) {
+        char buffer[BUFFER_SIZE];
+        ssize_t ret = read(in, buffer, sizeof(buffer));
+
+        if (ret < 0 && errno == EINTR)
+            continue;
+
+        if (ret <= 0)
+            break;
+
+        file_frames += count_frames(buffer, (size_t) ret);
+    }
+
+    /* Unlike send(), sendfile() cannot be told not to raise SIGPIPE. */
+    if (sigemptyset(&ignore.sa_mask) || sigaction(SIGPIPE, &ignore, NULL)) {
+        perror("Failed to ignore SIGPIPE");
+        close(in);
+        return 1;
+    }
+
+    load = create_load(opts);
+
+    if (!load) {
+        close(in);
+        return 1;
+    }
+
+    fprintf(stderr, "Opening %zu connections to %s:%" PRIu16 "\n", n, opts->addr, opts->port);
+    for (size_t i = 0U; i < n; ++i) {
+        load->pfds[i].fd = open_connection(addr);
+        load->pfds[i].events = POLLOUT;
+
+        if (load->pfds[i].fd < 0)
+            ++load->stats.failed;
+    }
+
+    start = load->start = now_ns();
+    end = start + (uint64_t) opts->duration * NSEC_PER_SEC;
+    next_report = start + report_period;
+
+    while (!interrupt_triggered) {
+        int active;
+
+        now = now_ns();
+
+        if (now >= end || load->stats.failed + load->stats.closed == n)
+            break;
+
+        if (now >= next_report) {
+            report_progress(load, &last, now - start, report_period);
+            last = load->stats;
+            next_report += report_period;
+        }
+
+        active = poll(load->pfds, (nfds_t) n, (int) (((next_report < end ? next_report : end) - now + 999999U) / 1000000U));
+
+        if (active < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("Failed to poll sockets");
+            break;
+        }
+
+        for (size_t i = 0U; i < n && active > 0; ++i) {
+            struct pollfd *pfd = &load->pfds[i];
+            struct connection *conn = &load->conns[i];
+
+            if (pfd->fd < 0 || !pfd->revents)
+                continue;
+
+            --active;
+
+            if (!conn->connected) {
+                if (!finish_connect(load, i, now))
+                    pfd->events = POLLIN | POLLOUT;
+
+                continue;
+            }
+
+            if ((pfd->revents & (POLLIN | POLLERR | POLLHUP)) && drain_socket(pfd->fd)) {
+                drop_connection(load, i);
+                continue;
+            }
+
+            if (pfd->revents & POLLOUT) {
+                /* One call per connection per wakeup keeps the connections
+                 * evenly served. The file is sent over and over, from the
+                 * start again each time it is finished.
+                 */
+                ssize_t ret = send_file(pfd->fd, in, &conn->offset, size - conn->offset);
+
+                if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    drop_connection(load, i);
+                    continue;
+                }
+
+                if (ret > 0)
+                    load->stats.bytes += (uint64_t) ret;
+
+                if (conn->offset == size) {
+                    conn->offset = 0U;
+                    load->stats.frames += file_frames;
+                    ++passes;
+                }
+            }
+        }
+    }
+
+    report_load(load, now_ns() - start);
+    printf("File passes:       %" PRIu64 " (%" PRIu64 " frames, %zu bytes each)\n", passes, file_frames, size);
+
+    destroy_load(load);
+    close(in);
+    return 0;
+}
+
+
+static void sleep_until(uint64_t deadline) {
+    uint64_t now;
+
+    while (!interrupt_triggered && (now = now_ns()) < deadline) {
+        struct timespec ts = {
+            .tv_sec = (time_t) ((deadline - now) / NSEC_PER_SEC),
+            .tv_nsec = (long) ((deadline - now) % NSEC_PER_SEC)
+        };
+
+        nanosleep(&ts, NULL);
+    }
+}
+
+
+static int run_replay(const struct options *opts, const struct sockaddr_in *addr) {
+    FILE *in;
+    int exit_status = 0;
+    uint64_t start, records = 0U, frames = 0U, bytes = 0U;
+    size_t opened = 0U, failed = 0U, lost = 0U;
+    double seconds;
+
+    char magic[CAPTURE_MAGIC_SIZE];
+    unsigned char header[CAPTURE_HEADER_SIZE];
+
+    /* Sockets indexed by the server's connection slot, grown as higher slots
+     * turn up.
+     */
+    int *sockets = NULL;
+    size_t n_sockets = 0U;
+
+    /* Frame payload plus its newline. */
+    char *payload = NULL;
+    size_t capacity = 0U;
+
+    struct histogram *lateness = calloc(1U, sizeof(*lateness));
+
+    if (!lateness) {
+        perror("Failed to allocate the latency histogram");
+        return 1;
+    }
+
+    in = opts->input ? fopen(opts->input, "rb") : stdin;
+
+    if (!in) {
+        fprintf(stderr, "Failed to open '%s'", opts->input);
+        perror(NULL);
+        free(lateness);
+        return 1;
+    }
+
+    if (fread(magic, sizeof(magic), 1U, in) != 1U || memcmp(magic, CAPTURE_MAGIC, sizeof(magic))) {
+        fprintf(stderr, "Input is not a traffic capture\n");
+
+        if (in != stdin)
+            fclose(in);
+
+        free(lateness);
+        return 1;
+    }
+
+    fprintf(stderr, "Replaying capture to %s:%" PRIu16 "\n", opts->addr, opts->port);
+    start = now_ns();
+
+    while (!interrupt_triggered && !exit_status && fread(header, sizeof(header), 1U, in) == 1U) {
+        struct capture_record record;
+        uint64_t due;
+        int *s;
+
+        capture_decode(header, &record);
+
+        /* Sizes are taken from the file, so are checked before anything is
+         * allocated for them.
+         */
+        if (record.length > REPLAY_MAX_FRAME) {
+            fprintf(stderr, "Capture is corrupt: frame of %" PRIu32 " bytes\n", record.length);
+            exit_status = 1;
+            break;
+        }
+
+        if (record.connection >= n_sockets + REPLAY_MAX_SLOT_GAP) {
+            fprintf(stderr, "Capture is corrupt: connection %" PRIu32 " after %zu\n", record.connection, n_sockets);
+            exit_status = 1;
+            break;
+        }
+
+        if (record.length + 1U > capacity) {
+            char *p = realloc(payload, record.length + 1U);
+
+            if (!p) {
+                perror("Failed to allocate frame buffer");
+                exit_status = 1;
+                break;
+            }
+
+            payload = p;
+            capacity = record.length + 1U;
+        }
+
+        if (record.length > 0U && fread(payload, record.length, 1U, in) != 1U) {
+            fprintf(stderr, "Capture is truncated\n");
+            exit_status = 1;
+            break;
+        }
+
+        if (record.connection >= n_sockets) {
+            size_t n = record.connection + 1U;
+            int *p = realloc(sockets, n * sizeof(*sockets));
+
+            if (!p) {
+                perror("Failed to allocate connection table");
+                exit_status = 1;
+                break;
+            }
+
+            for (size_t i = n_sockets; i < n; ++i)
+                p[i] = -1;
+
+            sockets = p;
+            n_sockets = n;
+        }
+
+        /* Hold each record back until its original time, stretched or
+         * squeezed by the time scale. Any lateness is down to the server
+         * holding up our writes.
+         */
+        due = start + (uint64_t) ((double) record.time * opts->scale);
+        sleep_until(due);
+
+        if (interrupt_triggered)
+            break;
+
+        histogram_record(lateness, now_ns() - due);
+        ++records;
+
+        s = &sockets[record.connection];
+
+        switch (record.type) {
+            case CAPTURE_CONNECT:
+                if (*s >= 0)
+                    close(*s);
+
+                *s = initialise_connection(addr);
+
+                if (*s < 0)
+                    ++failed;
+                else
+                    ++opened;
+
+                break;
+            case CAPTURE_FRAME:
+                if (*s < 0) {
+                    ++lost;
+                    break;
+                }
+
+                payload[record.length] = '\n';
+
+                if (write_socket(*s, payload, record.length + 1U)) {
+                    close(*s);
+                    *s = -1;
+                    ++lost;
+                    break;
+                }
+
+                ++frames;
+                bytes += record.length + 1U;
+                break;
+            case CAPTURE_CLOSE:
+            case CAPTURE_TIMEOUT:
+                /* Whether the client left or was timed out, it is gone by
+                 * now.
+                 */
+                if (*s >= 0) {
+                    close(*s);
+                    *s = -1;
+                }
+
+                break;
+            default:
+                fprintf(stderr, "Unknown capture record type %d\n", (int) record.type);
+                exit_status = 1;
+                break;
+        }
+    }
+
+    if (ferror(in)) {
+        perror("Failed to read capture");
+        exit_status = 1;
+    }
+
+    seconds = (double) (now_ns() - start) / (double) NSEC_PER_SEC;
+
+    printf("Duration:          %.3f s\n", seconds);
+    printf("Records replayed:  %" PRIu64 "\n", records);
+    printf("Connections:       %zu opened, %zu failed\n", opened, failed);
+    printf("Frames sent:       %" PRIu64 " (%zu lost to closed connections)\n", frames, lost);
+    printf("Bytes sent:        %" PRIu64 "\n", bytes);
+    printf("Throughput:        %.0f frames/s, %.2f MiB/s\n",
+        (double) frames / seconds,
+        (double) bytes / seconds / (1024.0 * 1024.0));
+    report_latency(lateness, "behind capture timing");
+
+    for (size_t i = 0U; i < n_sockets; ++i) {
+        if (sockets[i] >= 0)
+            close(sockets[i]);
+    }
+
+    if (in != stdin)
+        fclose(in);
+
+    free(sockets);
+    free(payload);
+    free(lateness);
+    return exit_status;
+}
+
+
+static int send_ping(struct load *load, size_t i) {
+    const size_t size = load->opts->frame_size;
+
+    struct pollfd *pfd = &load->pfds[i];
+    struct connection *conn = &load->conns[i];
+
+    while (conn->offset < size) {
+        ssize_t ret = send(pfd->fd, load->frame + conn->offset, size - conn->offset, MSG_NOSIGNAL);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                pfd->events |= POLLOUT;
+                return 0;
+            }
+
+            return 1;
+        }
+
+        conn->offset += (size_t) ret;
+        load->stats.bytes += (uint64_t) ret;
+    }
+
+    pfd->events &= (short) ~POLLOUT;
+    ++load->stats.frames;
+    return 0;
+}
+
+
+static int read_pong(struct load *load, size_t i, uint64_t now) {
+    const size_t size = load->opts->frame_size;
+
+    char buffer[BUFFER_SIZE];
+
+    struct connection *conn = &load->conns[i];
+
+    while (1) {
+        ssize_t ret = recv(load->pfds[i].fd, buffer, sizeof(buffer), 0);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+
+            return 1;
+        }
+
+        if (ret == 0)
+            return 1;
+
+        /* Only one ping is ever in flight, so anything beyond its echo is
+         * not ours.
+         */
+        conn->received += (size_t) ret;
+
+        if (!conn->awaiting || conn->received > size) {
+            fprintf(stderr, "Connection %zu received more than its echo\n", i);
+            return 1;
+        }
+
+        if (conn->received < size)
+            continue;
+
+        histogram_record(&load->latency, now - conn->last_sent);
+        conn->awaiting = false;
+        conn->received = 0U;
+        conn->offset = 0U;
+
+        /* The next ping is due an interval after the last one went out, or
+         * straight away if the round trip took longer than that.
+         */
+        conn->next_send = conn->last_sent + load->interval;
+
+        if (conn->next_send < now)
+            conn->next_send = now;
+    }
+}
+
+
+static int run_pingpong(const struct options *opts, const struct sockaddr_in *addr) {
+    const size_t n = opts->connections;
+    const uint64_t report_period = (uint64_t) REPORT_INTERVAL * NSEC_PER_SEC;
+
+    struct load_stats last = {0};
+    uint64_t start, end, next_report, now;
+
+    struct load *load = create_load(opts);
+
+    if (!load)
+        return 1;
+
+    fprintf(stderr, "Opening %zu connections to %s:%" PRIu16 "\n", n, opts->addr, opts->port);
+    for (size_t i = 0U; i < n; ++i) {
+        load->pfds[i].fd = open_connection(addr);
+        load->pfds[i].events = POLLOUT;
+
+        if (load->pfds[i].fd < 0)
+            ++load->stats.failed;
+    }
+
+    start = load->start = now_ns();
+    end = start + (uint64_t) opts->duration * NSEC_PER_SEC;
+    next_report = start + report_period;
+
+    while (!interrupt_triggered) {
+        uint64_t wake;
+        int active;
+
+        now = now_ns();
+
+        if (now >= end || load->stats.failed + load->stats.closed == n)
+            break;
+
+        if (now >= next_report) {
+            report_progress(load, &last, now - start, report_period);
+            last = load->stats;
+            next_report += report_period;
+        }
+
+        wake = next_report < end ? next_report : end;
+
+        /* Start a ping on every idle connection that is due one. */
+        for (size_t i = 0U; i < n; ++i) {
+            struct connection *conn = &load->conns[i];
+
+            if (load->pfds[i].fd < 0 || !conn->connected || conn->awaiting)
+                continue;
+
+            if (conn->next_send > now) {
+                if (conn->next_send < wake)
+                    wake = conn->next_send;
+
+                continue;
+            }
+
+            conn->awaiting = true;
+            conn->last_sent = now_ns();
+
+            if (send_ping(load, i))
+                drop_connection(load, i);
+        }
+
+        active = poll(load->pfds, (nfds_t) n, wake > now ? (int) ((wake - now + 999999U) / 1000000U) : 0);
+
+        if (active < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("Failed to poll sockets");
+            break;
+        }
+
+        now = now_ns();
+
+        for (size_t i = 0U; i < n && active > 0; ++i) {
+            struct pollfd *pfd = &load->pfds[i];
+            struct connection *conn = &load->conns[i];
+
+            if (pfd->fd < 0 || !pfd->revents)
+                continue;
+
+            --active;
+
+            if (!conn->connected) {
+                finish_connect(load, i, now);
+                continue;
+            }
+
+            /* The rest of a ping that did not fit in the socket buffer. */
+            if ((pfd->revents & POLLOUT) && send_ping(load, i)) {
+                drop_connection(load, i);
+                continue;
+            }
+
+            if ((pfd->revents & (POLLIN | POLLERR | POLLHUP)) && read_pong(load, i, now)) {
+                drop_connection(load, i);
+                continue;
+            }
+        }
+    }
+
+    report_load(load, now_ns() - start);
+    destroy_load(load);
+    return 0;
+}
+
+
+int main(int argc, char **argv) {
+    int exit_status;
+
+    struct options opts;
+    struct sockaddr_in addr;
+
+    if (parse_options(argc, argv, &opts))
+        return EXIT_FAILURE;
+
+    if (resolve_address(&opts, &addr))
+        return EXIT_FAILURE;
+
+    fprintf(stderr, "Enabling interrupt handler\n");
+    if (initialise_signal_handler(interrupt_handler, SIGINT))
+        return EXIT_FAILURE;
+
+    switch (opts.mode) {
+        case MODE_LOAD:
+        case MODE_IDLE:
+            exit_status = run_load(&opts, &addr);
+            break;
+        case MODE_CHURN:
+            exit_status = run_churn(&opts, &addr);
+            break;
+        case MODE_STREAM:
+            exit_status = run_stream(&opts, &addr);
+            break;
+        case MODE_SENDFILE:
+            exit_status = run_sendfile(&opts, &addr);
+            break;
+        case MODE_REPLAY:
+            exit_status = run_replay(&opts, &addr);
+            break;
+        case MODE_PINGPONG:
+            exit_status = run_pingpong(&opts, &addr);
+            break;
+        case MODE_INTERACTIVE:
+        default:
+            exit_status = run_interactive(&opts, &addr);
+            break;
+    }
+
+    return exit_status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
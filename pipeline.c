@@ -0,0 +1,281 @@
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipeline.h"
+
+
+struct processor {
+    struct pipeline *pipeline;
+    size_t id;
+
+    /* Batches handed to this thread, though any thread may take them. */
+    struct ring batches;
+
+    pthread_t thread;
+};
+
+struct pipeline {
+    frame_handler handler;
+    void *ctx;
+
+    size_t n;
+    struct processor *processors;
+
+    /* Posted once for every batch handed over, and once for every thread
+     * when stopping, which is set first.
+     */
+    sem_t ready;
+    bool stopping;
+
+    /* Batches handled by the threads, for the loop to reuse. */
+    struct queue done;
+
+    /* The loop's: the batch being filled, spare batches, the thread to hand
+     * the next batch to, and how many batches there are.
+     */
+    struct frame_batch *current;
+    struct queue_link *spare;
+    size_t next;
+    size_t allocated;
+};
+
+
+static void *run_processor(void *arg);
+static struct frame_batch *take_batch(struct processor *processor);
+static struct frame_batch *spare_batch(struct pipeline *pipeline);
+
+
+/* Waits for a batch and handles it, looking first at the thread's own, until
+ * stopping. Every batch has its own post, made after it is handed over, but
+ * a post does not reserve its batch: another thread may take it, leaving this
+ * one a later batch, handed over before its post was taken. So a thread that
+ * finds none looks again, until it finds one or, once stopping, there are
+ * none left.
+ */
+static void *run_processor(void *arg) {
+    struct processor *processor = arg;
+    struct pipeline *pipeline = processor->pipeline;
+
+    while (1) {
+        struct frame_batch *batch;
+
+        while (sem_wait(&pipeline->ready)) {
+            if (errno != EINTR) {
+                perror("Failed to wait for frames");
+                return NULL;
+            }
+        }
+
+        while (!(batch = take_batch(processor))) {
+            if (__atomic_load_n(&pipeline->stopping, __ATOMIC_ACQUIRE))
+                return NULL;
+        }
+
+        pipeline->handler(pipeline->ctx, batch);
+        queue_push(&pipeline->done, &batch->link);
+    }
+}
+
+
+static struct frame_batch *take_batch(struct processor *processor) {
+    struct pipeline *pipeline = processor->pipeline;
+
+    void *batch;
+
+    for (size_t k = 0U; k < pipeline->n; ++k) {
+        if (ring_take(&pipeline->processors[(processor->id + k) % pipeline->n].batches, &batch))
+            return batch;
+    }
+
+    return NULL;
+}
+
+
+static struct frame_batch *spare_batch(struct pipeline *pipeline) {
+    struct frame_batch *batch;
+
+    if (!pipeline->spare)
+        pipeline->spare = queue_take(&pipeline->done);
+
+    if (pipeline->spare) {
+        batch = (struct frame_batch *) pipeline->spare;
+        pipeline->spare = pipeline->spare->next;
+    } else {
+        batch = malloc(sizeof(*batch));
+
+        if (!batch) {
+            perror("Failed to allocate a frame batch");
+            return NULL;
+        }
+
+        ++pipeline->allocated;
+    }
+
+    batch->count = 0U;
+    batch->used = 0U;
+    return batch;
+}
+
+
+struct pipeline *pipeline_create(size_t threads, frame_handler handler, void *ctx) {
+    struct pipeline *pipeline = calloc(1U, sizeof(*pipeline));
+    sigset_t all, mask;
+    size_t started = 0U;
+
+    if (!pipeline || !(pipeline->processors = calloc(threads, sizeof(struct processor)))) {
+        perror("Failed to allocate pipeline");
+        free(pipeline);
+        return NULL;
+    }
+
+    pipeline->handler = handler;
+    pipeline->ctx = ctx;
+
+    if (sem_init(&pipeline->ready, 0, 0U)) {
+        perror("Failed to create pipeline semaphore");
+        free(pipeline->processors);
+        free(pipeline);
+        return NULL;
+    }
+
+    /* Signals are for the loop's thread, whose waits they cut short, so the
+     * processing threads are started with them all blocked.
+     */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &mask);
+
+    for (; started < threads; ++started) {
+        struct processor *processor = &pipeline->processors[started];
+        int err;
+
+        processor->pipeline = pipeline;
+        processor->id = started;
+
+        if (ring_init(&processor->batches, PIPELINE_DEPTH))
+            break;
+
+        err = pthread_create(&processor->thread, NULL, run_processor, processor);
+
+        if (err) {
+            errno = err;
+            perror("Failed to start processing thread");
+            ring_destroy(&processor->batches);
+            break;
+        }
+
+        /* Only now may the loop hand it batches. */
+        pipeline->n = started + 1U;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+
+    if (started < threads) {
+        pipeline_destroy(pipeline);
+        return NULL;
+    }
+
+    return pipeline;
+}
+
+
+void pipeline_add(struct pipeline *pipeline, size_t slot, uint64_t id, const char *frame, size_t n) {
+    struct frame_batch *batch = pipeline->current;
+
+    if (batch && (batch->count == BATCH_FRAMES || BATCH_DATA - batch->used <= n))
+        pipeline_flush(pipeline);
+
+    if (!pipeline->current && !(pipeline->current = spare_batch(pipeline)))
+        return;
+
+    batch = pipeline->current;
+    batch->frames[batch->count++] = (struct frame) {
+        .slot = slot,
+        .id = id,
+        .offset = batch->used,
+        .len = n
+    };
+
+    memcpy(batch->data + batch->used, frame, n);
+    batch->data[batch->used + n] = '\0';
+    batch->used += n + 1U;
+}
+
+
+void pipeline_flush(struct pipeline *pipeline) {
+    struct frame_batch *batch = pipeline->current;
+
+    if (!batch || batch->count == 0U)
+        return;
+
+    pipeline->current = NULL;
+
+    /* Round the threads, skipping any with a full backlog. */
+    for (size_t k = 0U; k < pipeline->n; ++k) {
+        struct processor *processor = &pipeline->processors[pipeline->next];
+
+        pipeline->next = (pipeline->next + 1U) % pipeline->n;
+
+        if (ring_push(&processor->batches, batch)) {
+            sem_post(&pipeline->ready);
+            return;
+        }
+    }
+
+    /* Every thread is behind, so the loop has to keep up with them. */
+    pipeline->handler(pipeline->ctx, batch);
+    batch->link.next = pipeline->spare;
+    pipeline->spare = &batch->link;
+}
+
+
+size_t pipeline_memory(const struct pipeline *pipeline) {
+    return pipeline->allocated * sizeof(struct frame_batch);
+}
+
+
+void pipeline_destroy(struct pipeline *pipeline) {
+    struct queue_link *link;
+
+    if (!pipeline)
+        return;
+
+    pipeline_flush(pipeline);
+
+    __atomic_store_n(&pipeline->stopping, true, __ATOMIC_RELEASE);
+
+    for (size_t i = 0U; i < pipeline->n; ++i)
+        sem_post(&pipeline->ready);
+
+    for (size_t i = 0U; i < pipeline->n; ++i) {
+        pthread_join(pipeline->processors[i].thread, NULL);
+        ring_destroy(&pipeline->processors[i].batches);
+    }
+
+    /* Every batch is now either spare or handled. */
+    free(pipeline->current);
+
+    link = queue_take(&pipeline->done);
+
+    while (link) {
+        struct queue_link *next = link->next;
+
+        free(link);
+        link = next;
+    }
+
+    while (pipeline->spare) {
+        link = pipeline->spare;
+        pipeline->spare = link->next;
+        free(link);
+    }
+
+    sem_destroy(&pipeline->ready);
+    free(pipeline->processors);
+    free(pipeline);
+}
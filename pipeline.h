@@ -0,0 +1,74 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ring.h"
+
+
+/* Frames handed from an event loop to a pool of threads to handle, so that
+ * however long handling takes, it never holds up the loop. Frames are copied
+ * into batches, which are handed over whole, each to the next thread in turn,
+ * and a thread with none of its own steals from the others. Frames in one
+ * batch are handled in order, but batches may be handled in any order.
+ */
+
+enum {
+    /* Most frames, and bytes of them, in a batch. */
+    BATCH_FRAMES = 128,
+    BATCH_DATA = 16 * 1024,
+
+    /* Batches each thread can have waiting. */
+    PIPELINE_DEPTH = 64
+};
+
+struct frame {
+    /* The slot of the connection it came from, and the connection's id,
+     * which tells it apart from later connections in the same slot.
+     */
+    size_t slot;
+    uint64_t id;
+
+    /* Where it is in the batch's data, null-terminated, and its length. */
+    size_t offset;
+    size_t len;
+};
+
+struct frame_batch {
+    /* For returning it to the loop once handled. */
+    struct queue_link link;
+
+    size_t count;
+    size_t used;
+    struct frame frames[BATCH_FRAMES];
+    char data[BATCH_DATA];
+};
+
+/* Handles a batch of frames, on one of the pipeline's threads, or on the
+ * loop's own when every thread has a full backlog.
+ */
+typedef void (*frame_handler)(void *ctx, const struct frame_batch *batch);
+
+struct pipeline;
+
+/* Start a pipeline of the given number of threads. Returns NULL on
+ * failure.
+ */
+struct pipeline *pipeline_create(size_t threads, frame_handler handler, void *ctx);
+
+/* Add a frame of n bytes to the batch being filled, handing it over first if
+ * it has no room. n must be less than BATCH_DATA. Loop only.
+ */
+void pipeline_add(struct pipeline *pipeline, size_t slot, uint64_t id, const char *frame, size_t n);
+
+/* Hand over the batch being filled, if it has any frames. Loop only. */
+void pipeline_flush(struct pipeline *pipeline);
+
+/* Bytes taken by the batches allocated so far. */
+size_t pipeline_memory(const struct pipeline *pipeline);
+
+/* Handle every frame added, then stop the threads. */
+void pipeline_destroy(struct pipeline *pipeline);
+
+#endif
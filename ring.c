@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ring.h"
+
+
+int ring_init(struct ring *ring, size_t capacity) {
+    size_t size = 1U;
+
+    /* A power of two, so that indices wrap with a mask. */
+    while (size < capacity)
+        size *= 2U;
+
+    *ring = (struct ring) {
+        .entries = malloc(size * sizeof(void *)),
+        .mask = size - 1U
+    };
+
+    if (!ring->entries) {
+        perror("Failed to allocate ring");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+void ring_destroy(struct ring *ring) {
+    free(ring->entries);
+    ring->entries = NULL;
+}
+
+
+/* The indices only ever increase, wrapping around SIZE_MAX, so the number of
+ * entries is always their difference. An entry is written before the tail is
+ * released past it, and read before the head is, so the acquiring side never
+ * sees a slot in use by the other.
+ */
+bool ring_push(struct ring *ring, void *entry) {
+    const size_t tail = ring->tail;
+
+    if (tail - ring->head_seen > ring->mask) {
+        ring->head_seen = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        if (tail - ring->head_seen > ring->mask)
+            return false;
+    }
+
+    /* Atomic for ring_take(), which may read it while it is written,
+     * though only to then throw it away.
+     */
+    __atomic_store_n(&ring->entries[tail & ring->mask], entry, __ATOMIC_RELAXED);
+    __atomic_store_n(&ring->tail, tail + 1U, __ATOMIC_RELEASE);
+    return true;
+}
+
+
+bool ring_pop(struct ring *ring, void **entry) {
+    const size_t head = ring->head;
+
+    if (head == ring->tail_seen) {
+        ring->tail_seen = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+        if (head == ring->tail_seen)
+            return false;
+    }
+
+    *entry = ring->entries[head & ring->mask];
+    __atomic_store_n(&ring->head, head + 1U, __ATOMIC_RELEASE);
+    return true;
+}
+
+
+/* The entry is read before claiming it, as once the head moves on the
+ * producer may reuse its place. A failed claim means another consumer got
+ * there first, and what was read is discarded.
+ */
+bool ring_take(struct ring *ring, void **entry) {
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    do {
+        if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+            return false;
+
+        *entry = __atomic_load_n(&ring->entries[head & ring->mask], __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&ring->head, &head, head + 1U, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    return true;
+}
+
+
+void queue_push(struct queue *queue, struct queue_link *link) {
+    link->next = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+
+    /* A failed exchange loads the head it found into link->next for the
+     * next try.
+     */
+    while (!__atomic_compare_exchange_n(&queue->head, &link->next, link, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+
+struct queue_link *queue_take(struct queue *queue) {
+    struct queue_link *link = __atomic_exchange_n(&queue->head, NULL, __ATOMIC_ACQUIRE);
+    struct queue_link *oldest = NULL;
+
+    /* Messages are pushed on the front, so reverse them. */
+    while (link) {
+        struct queue_link *next = link->next;
+
+        link->next = oldest;
+        oldest = link;
+        link = next;
+    }
+
+    return oldest;
+}
@@ -0,0 +1,80 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+/* A bounded queue of pointers handed from one thread to another without
+ * locks: only one thread may push, and only one may pop, unless they all use
+ * ring_take(). Each side keeps its index on its own cache line, along with
+ * the last index it read of the other's, so that the two only share a line
+ * when one has to look again.
+ */
+
+enum {
+    CACHE_LINE_SIZE = 64
+};
+
+struct ring {
+    void **entries;
+    size_t mask;
+
+    /* The consumer's: where the next entry is popped from, and where the
+     * producer last had pushed to.
+     */
+    char pad0[CACHE_LINE_SIZE];
+    size_t head;
+    size_t tail_seen;
+
+    /* The producer's: where the next entry is pushed to, and where the
+     * consumer last had popped from.
+     */
+    char pad1[CACHE_LINE_SIZE - 2U * sizeof(size_t)];
+    size_t tail;
+    size_t head_seen;
+    char pad2[CACHE_LINE_SIZE - 2U * sizeof(size_t)];
+};
+
+/* Initialise a ring holding at least capacity entries. Returns 1 on
+ * failure.
+ */
+int ring_init(struct ring *ring, size_t capacity);
+void ring_destroy(struct ring *ring);
+
+/* Push an entry, returning false if the ring is full. Producer only. */
+bool ring_push(struct ring *ring, void *entry);
+
+/* Pop the oldest entry, returning false if the ring is empty. Consumer
+ * only.
+ */
+bool ring_pop(struct ring *ring, void **entry);
+
+/* Pop the oldest entry like ring_pop(), but safely with any number of
+ * consumers, as long as all of them use this.
+ */
+bool ring_take(struct ring *ring, void **entry);
+
+
+/* An unbounded queue of messages from any number of threads to one, without
+ * locks. Messages are linked through a struct queue_link at their start, and
+ * taken all at once.
+ */
+
+struct queue_link {
+    struct queue_link *next;
+};
+
+struct queue {
+    struct queue_link *head;
+};
+
+/* Push a message. Any thread. */
+void queue_push(struct queue *queue, struct queue_link *link);
+
+/* Take every message pushed so far, oldest first, or NULL if there are none.
+ * Consumer only.
+ */
+struct queue_link *queue_take(struct queue *queue);
+
+#endif
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -8,30 +9,44 @@
 #include <string.h>
 #include <time.h>
 
-#include <fcntl.h>
-#include <netinet/in.h>
-#include <netinet/ip.h>
-#include <poll.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <unistd.h>
 
+#include "sockets.h"
+#include "table.h"
+#include "timeout_server.h"
+#include "timer.h"
+#include "workers.h"
 
-/* Maximum number of clients (including the master socket). Must be > 1. */
+
+/* The server program: prints what its clients send, configured from the
+ * command line, on the server library (see timeout_server.h, sockets.h and
+ * workers.h).
+ */
+
+
+/* Default maximum number of clients (including the master socket). Must be
+ * > 1.
+ */
 static const size_t MAX_CONNECTIONS = 10U;
 
 /* Default listening port. */
 static const uint16_t PORT = 1337U;
 
-/* Size of the server's receive buffer, including allocation for a 1-byte null
- * terminator (hence must be > 1).
- */
-static const size_t BUFFER_SIZE = 1024U;
-
 /* Default client timeout in seconds. */
 static const time_t TIMEOUT = 30;
 
 /* Signal to raise upon a client timeout. */
 static const int TIMEOUT_SIGNAL = SIGUSR1;
 
+/* Signal asking for a report of the server's memory use. */
+static const int REPORT_SIGNAL = SIGUSR2;
+
+/* Maximum number of workers. */
+static const size_t MAX_WORKERS = 1024U;
+
 
 /* Global flag to indicate that a client has timed out. */
 static volatile sig_atomic_t timeout_triggered = 0;
@@ -39,76 +54,88 @@ static volatile sig_atomic_t timeout_triggered = 0;
 /* Global flag to indicate that an interrupt signal has been delivered. */
 static volatile sig_atomic_t interrupt_triggered = 0;
 
+/* Global flag to indicate that a memory report has been asked for. */
+static volatile sig_atomic_t report_triggered = 0;
 
-static int create_timers(timer_t *timers, size_t n);
-static int destroy_timers(timer_t *timers, size_t n);
-static int arm_timer(timer_t timer);
-static int disarm_timer(timer_t timer);
-static bool timer_expired(timer_t timer);
 
-static int initialise_listening_socket(struct pollfd *pfds);
-static int accept_connection(struct pollfd *pfds, timer_t *timers);
-static void close_connection(struct pollfd *pfd, timer_t timer);
+static void print_frame(void *ctx, struct server *server, size_t i, uint64_t id, const char *frame, size_t n);
+static void report_usage(void);
 
 static int initialise_signal_handler(void (*signal_handler)(int), int signal);
 static void interrupt_handler(int signal);
 static void timeout_handler(int signal);
+static void report_handler(int signal);
 
-static int initialise_server(struct pollfd *pfds, timer_t *timers, size_t n);
-static int event_loop(struct pollfd *pfds, timer_t *timers, size_t n);
-static int shutdown_server(struct pollfd *pfds, timer_t *timers, size_t n);
+static void usage(const char *name);
+static int parse_size(const char *arg, size_t *value);
+static int parse_double(const char *arg, double *value);
+static int parse_cpus(const char *arg, int **cpus, size_t *n);
+static int parse_options(int argc, char **argv, struct server_options *opts);
 
+static int initialise_server(struct server *server, struct timer_engine **timers, const struct server_options *opts);
+static int shutdown_server(struct server *server, struct timer_engine *timers);
+static int run_workers(const struct server_options *opts);
 
-static int create_timers(timer_t *timers, size_t n) {
-    for (size_t i = 0U; i < n; ++i) {
-        struct sigevent event = {
-            .sigev_notify = SIGEV_SIGNAL,
-            .sigev_signo = TIMEOUT_SIGNAL,
-            .sigev_value.sival_ptr = timers[i]
-        };
 
-        if (timer_create(CLOCK_REALTIME, &event, &timers[i])) {
-            perror("Failed to create timer");
-            destroy_timers(timers, i);
-            return 1;
-        }
-    }
+/* The server's handler: frames are printed, and nothing else is done. */
+static const struct server_handler PRINT_HANDLER = {
+    .ctx = NULL,
+    .on_connect = NULL,
+    .on_frame = print_frame,
+    .on_timeout = NULL,
+    .on_close = NULL
+};
 
-    return 0;
-}
 
+/* Client numbers are per server, so a worker's are told apart by its name.
+ * The line is kept in one piece among other threads' output.
+ */
+static void print_frame(void *ctx, struct server *server, size_t i, uint64_t id, const char *frame, size_t n) {
+    (void) ctx;
+    (void) id;
+    (void) n;
 
-static int destroy_timers(timer_t *timers, size_t n) {
-    for (size_t i = 0U; i < n; ++i) {
-        if (timer_delete(timers[i])) {
-            perror("Failed to destroy timer");
-            return 1;
-        }
-    }
+    flockfile(stdout);
 
-    return 0;
+    if (server->name)
+        printf("[%s] ", server->name);
+
+    printf("[Client %zu] %s\n", i, frame);
+    funlockfile(stdout);
 }
 
 
-static int arm_timer(timer_t timer) {
-    struct itimerspec its = {
-        .it_value.tv_sec = TIMEOUT
-    };
+static void report_usage(void) {
+    struct rusage usage;
 
-    if (timer_settime(timer, 0, &its, NULL)) {
-        perror("Failed to arm timer");
-        return 1;
+    if (getrusage(RUSAGE_SELF, &usage)) {
+        perror("Failed to get resource usage");
+        return;
     }
 
-    return 0;
+    /* The maximum resident set size is in kilobytes on Linux and the BSDs,
+     * but in bytes on macOS.
+     */
+    fprintf(stderr, "Resource usage: %.3f s user, %.3f s system, %ld max RSS\n",
+        (double) usage.ru_utime.tv_sec + (double) usage.ru_utime.tv_usec / 1e6,
+        (double) usage.ru_stime.tv_sec + (double) usage.ru_stime.tv_usec / 1e6,
+        usage.ru_maxrss);
 }
 
 
-static int disarm_timer(timer_t timer) {
-    struct itimerspec its = {0};
+static int initialise_signal_handler(void (*signal_handler)(int), int signal) {
+    struct sigaction action = {
+        .sa_handler = signal_handler
+    };
+
+    if (sigemptyset(&action.sa_mask)) {
+        perror("Failed to initialise the signal mask");
+        return 1;
+    }
 
-    if (timer_settime(timer, 0, &its, NULL)) {
-        perror("Failed to disarm timer");
+    if (sigaction(signal, &action, NULL)) {
+        fprintf(stderr, "Failed to change signal %d action to handler", signal);
+        perror(NULL);
         return 1;
     }
 
@@ -116,344 +143,438 @@ static int disarm_timer(timer_t timer) {
 }
 
 
-static bool timer_expired(timer_t timer) {
-    struct itimerspec its;
-
-    if (timer_gettime(timer, &its)) {
-        perror("Failed to get state of timer");
-        exit(EXIT_FAILURE);
-    }
+static void interrupt_handler(int sig) {
+    /* Avoid unused parameter warning. */
+    (void) sig;
+    interrupt_triggered = 1;
+}
 
-    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
-        return true;
 
-    return false;
+static void timeout_handler(int sig) {
+    /* Avoid unused parameter warning. */
+    (void) sig;
+    timeout_triggered = 1;
 }
 
 
-static int initialise_listening_socket(struct pollfd *pfds) {
-    const int SOCK_OPT = 1;
+static void report_handler(int sig) {
+    /* Avoid unused parameter warning. */
+    (void) sig;
+    report_triggered = 1;
+}
 
-    int flags;
 
-    struct sockaddr_in addr = {
-        .sin_family = AF_INET,
-        .sin_addr.s_addr = htonl(INADDR_ANY),
-        .sin_port = htons(PORT)
-    };
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-n MAX_CONNECTIONS] [-p PORT] [-t TIMEOUT] [-T posix|heap] [-e | -k] [-w CAPTURE_FILE] [-m MEMORY_BUDGET] [-H] [-L] [-W CPUS [-S]] [-b SPIN_USEC] [-B BUSY_POLL_USEC] [-A] [-R BALANCE_INTERVAL] [-P PROCESSORS]\n", name);
+}
 
-    /* Create server's master socket. */
-    int s = socket(AF_INET, SOCK_STREAM, 0);
 
-    if (s < 0) {
-        perror("Failed to create socket");
-        return 1;
-    }
+static int parse_size(const char *arg, size_t *value) {
+    char *end;
+    unsigned long long n;
+
+    errno = 0;
+    n = strtoull(arg, &end, 10);
 
-    /* Allow rebinding of the listening address and port. */
-    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const void *) &SOCK_OPT, (socklen_t) sizeof(SOCK_OPT))) {
-        perror("Failed to set socket for reuse");
-        close(s);
+    if (errno || end == arg || *end != '\0' || arg[0] == '-' || n > SIZE_MAX)
         return 1;
-    }
 
-    /* Set the socket's O_NONBLOCK flag so its I/O is nonblocking. */
-    flags = fcntl(s, F_GETFL, 0);
+    *value = (size_t) n;
+    return 0;
+}
 
-    if (flags == -1) {
-        perror("Failed to get socket flags");
-        close(s);
-        return 1;
-    }
 
-    if (fcntl(s, F_SETFL, flags | O_NONBLOCK)) {
-        perror("Failed to set socket to nonblocking mode");
-        close(s);
-        return 1;
-    }
+static int parse_double(const char *arg, double *value) {
+    char *end;
+    double n;
 
-    /* Bind the socket to its address. */
-    if (bind(s, (struct sockaddr *) &addr, (socklen_t) sizeof(addr))) {
-        perror("Failed to bind socket");
-        close(s);
-        return 1;
-    }
+    errno = 0;
+    n = strtod(arg, &end);
 
-    /* Set socket to listen. */
-    if (listen(s, MAX_CONNECTIONS - 1U)) {
-        perror("Failed to set socket to a listening state");
-        close(s);
+    if (errno || end == arg || *end != '\0' || !(n >= 0.0))
         return 1;
-    }
 
-    /* The first element of the pollfd (and timer_t) array will be reserved for
-     * the server. Obviously, we will not arm a timer for this socket.
-     */
-    pfds[0].fd = s;
-    pfds[0].events = POLLIN;
+    *value = n;
     return 0;
 }
 
 
-static int accept_connection(struct pollfd *pfds, timer_t *timers) {
-    /* Accept connection request. */
-    int s = accept(pfds[0].fd, NULL, NULL);
+static int parse_cpus(const char *arg, int **cpus, size_t *n) {
+    int *list = malloc(MAX_WORKERS * sizeof(*list));
+    const char *p = arg;
 
-    if (s < 0) {
-        perror("Failed to accept connection request");
+    if (!list) {
+        perror("Failed to allocate the CPU list");
         return 1;
     }
 
-    /* Find spare slot for socket (we can skip the master socket at i = 0). */
-    for (size_t i = 1U; i < MAX_CONNECTIONS; ++i) {
-        struct pollfd *pfd = &pfds[i];
+    *n = 0U;
 
-        if (pfd->fd < 0) {
-            pfd->fd = s;
-            pfd->events = POLLIN;
+    /* A comma-separated list of CPUs and ranges of them, as in "0,2,4-7". */
+    while (1) {
+        char *end;
+        long first, last;
 
-            /* Arm the client's timeout timer. */
-            if (arm_timer(timers[i])) {
-                close_connection(pfd, timers[i]);
-                return 1;
-            }
+        errno = 0;
+        first = strtol(p, &end, 10);
+        last = first;
 
-            fprintf(stderr, "Client %zu connected\n", i);
-            return 0;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
         }
-    }
 
-    fprintf(stderr, "Too many connections already accepted\n");
-    close(s);
-    return 1;
-}
+        if (errno || end == p || first < 0 || last < first || last > INT_MAX || (size_t) (last - first) >= MAX_WORKERS - *n) {
+            free(list);
+            return 1;
+        }
+
+        for (long cpu = first; cpu <= last; ++cpu)
+            list[(*n)++] = (int) cpu;
+
+        if (*end == '\0')
+            break;
+
+        if (*end != ',') {
+            free(list);
+            return 1;
+        }
 
+        p = end + 1;
+    }
 
-static void close_connection(struct pollfd *pfd, timer_t timer) {
-    disarm_timer(timer);
-    close(pfd->fd);
-    pfd->fd = -1;
+    *cpus = list;
+    return 0;
 }
 
 
-static int initialise_signal_handler(void (*signal_handler)(int), int signal) {
-    struct sigaction action = {
-        .sa_handler = signal_handler
+static int parse_options(int argc, char **argv, struct server_options *opts) {
+    int opt;
+    bool timers_chosen = false;
+
+    *opts = (struct server_options) {
+        .max_connections = MAX_CONNECTIONS,
+        .port = PORT,
+        .timeout.tv_sec = TIMEOUT,
+        .timers = SERVER_TIMERS_POSIX,
+        .capture_path = NULL,
+        .ack = false,
+        .echo = false,
+        .memory_budget = 0U,
+        .table_flags = 0U,
+        .cpus = NULL,
+        .workers = 0U,
+        .steer = false,
+        .spin = 0U,
+        .busy_poll = 0,
+        .acceptor = false,
+        .balance = {0, 0},
+        .processors = 0U
     };
 
-    if (sigemptyset(&action.sa_mask)) {
-        perror("Failed to initialise the signal mask");
+    while ((opt = getopt(argc, argv, "n:p:t:T:ekw:m:HLW:Sb:B:AR:P:")) != -1) {
+        size_t n;
+        double timeout, interval;
+
+        switch (opt) {
+            case 'n':
+                if (parse_size(optarg, &opts->max_connections) || opts->max_connections < 2U) {
+                    fprintf(stderr, "Invalid connection limit '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'p':
+                if (parse_size(optarg, &n) || n == 0U || n > UINT16_MAX) {
+                    fprintf(stderr, "Invalid port '%s'\n", optarg);
+                    return 1;
+                }
+                opts->port = (uint16_t) n;
+                break;
+            case 't':
+                /* A zero timeout would disarm the timers instead. */
+                if (parse_double(optarg, &timeout) || timeout < 1e-9 || timeout > (double) INT32_MAX) {
+                    fprintf(stderr, "Invalid timeout '%s'\n", optarg);
+                    return 1;
+                }
+                opts->timeout.tv_sec = (time_t) timeout;
+                opts->timeout.tv_nsec = (long) ((timeout - (double) opts->timeout.tv_sec) * 1e9);
+                break;
+            case 'T':
+                if (!strcmp(optarg, "posix")) {
+                    opts->timers = SERVER_TIMERS_POSIX;
+                } else if (!strcmp(optarg, "heap")) {
+                    opts->timers = SERVER_TIMERS_HEAP;
+                } else {
+                    fprintf(stderr, "Invalid timer engine '%s'\n", optarg);
+                    return 1;
+                }
+                timers_chosen = true;
+                break;
+            case 'e':
+                opts->echo = true;
+                break;
+            case 'k':
+                opts->ack = true;
+                break;
+            case 'w':
+                opts->capture_path = optarg;
+                break;
+            case 'm':
+                if (parse_size(optarg, &opts->memory_budget)) {
+                    fprintf(stderr, "Invalid memory budget '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'H':
+                opts->table_flags |= TABLE_HUGE_PAGES;
+                break;
+            case 'L':
+                opts->table_flags |= TABLE_LOCKED;
+                break;
+            case 'W':
+                free(opts->cpus);
+                if (parse_cpus(optarg, &opts->cpus, &opts->workers)) {
+                    fprintf(stderr, "Invalid CPU list '%s'\n", optarg);
+                    opts->cpus = NULL;
+                    return 1;
+                }
+                break;
+            case 'S':
+                opts->steer = true;
+                break;
+            case 'b':
+                if (parse_size(optarg, &opts->spin)) {
+                    fprintf(stderr, "Invalid spin time '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'B': {
+                size_t busy_poll;
+
+                if (parse_size(optarg, &busy_poll) || busy_poll > (size_t) INT_MAX) {
+                    fprintf(stderr, "Invalid busy poll time '%s'\n", optarg);
+                    return 1;
+                }
+
+                opts->busy_poll = (int) busy_poll;
+                break;
+            }
+            case 'A':
+                opts->acceptor = true;
+                break;
+            case 'R':
+                if (parse_double(optarg, &interval) || interval > (double) INT32_MAX) {
+                    fprintf(stderr, "Invalid balancing interval '%s'\n", optarg);
+                    return 1;
+                }
+                opts->balance.tv_sec = (time_t) interval;
+                opts->balance.tv_nsec = (long) ((interval - (double) opts->balance.tv_sec) * 1e9);
+                break;
+            case 'P':
+                if (parse_size(optarg, &opts->processors) || opts->processors > MAX_WORKERS) {
+                    fprintf(stderr, "Invalid number of processing threads '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind < argc) {
+        usage(argv[0]);
         return 1;
     }
 
-    if (sigaction(signal, &action, NULL)) {
-        fprintf(stderr, "Failed to change signal %d action to handler", signal);
-        perror(NULL);
+    /* Acknowledgements and echoes would be interleaved on the socket. */
+    if (opts->ack && opts->echo) {
+        fprintf(stderr, "Ack and echo modes cannot be combined\n");
         return 1;
     }
 
-    return 0;
-}
+    /* Echoes are written from the loop, as it reads. */
+    if (opts->echo && opts->processors > 0U) {
+        fprintf(stderr, "Echo mode cannot be used with processing threads\n");
+        return 1;
+    }
 
+    if (opts->workers > 0U) {
+        /* A POSIX timer's signal goes to whichever thread will take it, not
+         * the worker whose timer it is.
+         */
+        if (timers_chosen && opts->timers == SERVER_TIMERS_POSIX) {
+            fprintf(stderr, "Workers cannot use POSIX timers\n");
+            return 1;
+        }
 
-static void interrupt_handler(int sig) {
-    /* Avoid unused parameter warning. */
-    (void) sig;
-    interrupt_triggered = 1;
-}
+        /* The workers would all be writing the one file. */
+        if (opts->capture_path) {
+            fprintf(stderr, "Traffic capture cannot be used with workers\n");
+            return 1;
+        }
+
+        /* With one listening socket, there is nothing to steer between. */
+        if (opts->steer && opts->acceptor) {
+            fprintf(stderr, "Steering connections cannot be used with an acceptor\n");
+            return 1;
+        }
 
+        opts->timers = SERVER_TIMERS_HEAP;
+    } else if (opts->steer || opts->acceptor || opts->balance.tv_sec > 0 || opts->balance.tv_nsec > 0) {
+        fprintf(stderr, "Steering connections, an acceptor and balancing need workers\n");
+        return 1;
+    }
 
-static void timeout_handler(int sig) {
-    /* Avoid unused parameter warning. */
-    (void) sig;
-    timeout_triggered = 1;
+    return 0;
 }
 
 
-static int initialise_server(struct pollfd *pfds, timer_t *timers, size_t n) {
-    /* Initialising the socket array (-1 is used in this program to denote an
-     * unused connection slot).
-     */
-    for (size_t i = 0U; i < n; ++i)
-        pfds[i].fd = -1;
+static int initialise_server(struct server *server, struct timer_engine **timers, const struct server_options *opts) {
+    const size_t n = opts->max_connections;
+
+    int listener;
 
     fprintf(stderr, "Enabling timeout handler\n");
     if (initialise_signal_handler(timeout_handler, TIMEOUT_SIGNAL))
         return 1;
-    
+
     fprintf(stderr, "Enabling interrupt handler\n");
     if (initialise_signal_handler(interrupt_handler, SIGINT))
         return 1;
-    
+
+    fprintf(stderr, "Enabling memory report handler\n");
+    if (initialise_signal_handler(report_handler, REPORT_SIGNAL))
+        return 1;
+
     fprintf(stderr, "Creating timeout timers\n");
-    if (create_timers(timers, n))
+    *timers = opts->timers == SERVER_TIMERS_HEAP ? create_heap_engine(n, opts->table_flags) : create_posix_engine(n, TIMEOUT_SIGNAL, &timeout_triggered, opts->table_flags);
+
+    if (!*timers)
         return 1;
 
+    raise_file_limit(n);
+
     fprintf(stderr, "Initialising listening socket\n");
-    if (initialise_listening_socket(pfds)) {
-        destroy_timers(timers, n);
+    if (initialise_listening_socket(&listener, opts, -1)) {
+        (*timers)->destroy(*timers);
         return 1;
     }
 
+    if (server_init(server, opts, &SOCKET_BACKEND, &PRINT_HANDLER, *timers, listener, &interrupt_triggered)) {
+        close(listener);
+        (*timers)->destroy(*timers);
+        return 1;
+    }
+
+    server->report = &report_triggered;
     fprintf(stderr, "Server initialised\n");
     return 0;
 }
 
 
-static int shutdown_server(struct pollfd *pfds, timer_t *timers, size_t n) {
-    fprintf(stderr, "Closing all client connections\n");
-    for (size_t i = 0U; i < MAX_CONNECTIONS; ++i)
-        close_connection(&pfds[i], timers[i]);
+static int shutdown_server(struct server *server, struct timer_engine *timers) {
+    /* Report memory before the connections are closed, while it is still in
+     * use.
+     */
+    server_report_memory(server, stderr);
+    server_report_waits(server, stderr);
+    server_shutdown(server);
 
     fprintf(stderr, "Destroying timeout timers\n");
-    destroy_timers(timers, MAX_CONNECTIONS);
+    timers->destroy(timers);
 
+    report_usage();
     fprintf(stderr, "Server shut down\n");
     return 0;
 }
 
 
-static int event_loop(struct pollfd *pfds, timer_t *timers, size_t n) {
-    while (1) {
-        int active;
+static int run_workers(const struct server_options *opts) {
+    struct workers *workers;
+    sigset_t signals;
+    int status = 0;
 
-        /* If an interrupt signal (Ctrl-C) is raised. */
-        if (interrupt_triggered)
-            return 0;
+    /* The main thread takes the interrupt and report signals with sigwait()
+     * and passes them on, so they are blocked.
+     */
+    if (sigemptyset(&signals) || sigaddset(&signals, SIGINT) || sigaddset(&signals, REPORT_SIGNAL) || pthread_sigmask(SIG_BLOCK, &signals, NULL)) {
+        perror("Failed to block signals");
+        return 1;
+    }
 
-        /* After processing incoming data from each socket, we check to see if
-         * any socket has timed out. This is done at the start of the loop so
-         * that if poll() raises an EINTR error from the timeout alarm we can
-         * check the timers.
-         */
-        if (timeout_triggered) {
-            /* Reset flag at start of check so any timer can go off during the
-             * check and just wait till after to get attended to.
-             */
-            timeout_triggered = 0;
-
-            /* It is impossible to reliably count signals, so we must check
-             * every single connection for a timeout.
-             */
-            for (size_t i = 1U; i < n; ++i) {
-                timer_t timer = timers[i];
-                struct pollfd *pfd = &pfds[i];
-
-                if (pfd->fd >= 0 && timer_expired(timer)) {
-                    fprintf(stderr, "Client %zu timed out\n", i);
-                    close_connection(pfd, timer);
-                }
-            }
-        }
+    workers = workers_start(opts, &PRINT_HANDLER);
 
-        /* Poll sockets for any activity. */
-        active = poll(pfds, (nfds_t) n, -1);
+    if (!workers)
+        return 1;
 
-        if (active <= 0) {
-            /* If poll() was interrupted by a signal (timer alarm or
-             * interrupt), we just continue. Other errors can also be handled
-             * gracefully
-             */
-            if (errno == EINTR)
-                continue;
-            
-            perror("Failed to poll sockets");
-            return 0;
-        }
+    /* The listening sockets are up, so connections are queued from now on. */
+    fprintf(stderr, "Server initialised\n");
 
-        /* Iterate over sockets until all active ones have been processed. Make
-         * sure to break if the user raises an interrupt signal too.
-         */
-        for (size_t i = 0U; i < MAX_CONNECTIONS && active > 0 && !interrupt_triggered; ++i) {
-            ssize_t ret;
-            char buffer[BUFFER_SIZE];
+    while (1) {
+        int sig;
 
-            struct pollfd *pfd = &pfds[i];
-            timer_t timer = timers[i];
+        /* Balance the workers whenever no signal comes in time. */
+        if (opts->balance.tv_sec > 0 || opts->balance.tv_nsec > 0) {
+            sig = sigtimedwait(&signals, NULL, &opts->balance);
 
-            /* Skip empty client slots or clients without any I/O events. */
-            if (pfd->fd < 0 || !pfd->revents)
-                continue;
+            if (sig < 0 && (errno == EAGAIN || errno == EINTR)) {
+                if (errno == EAGAIN)
+                    workers_balance(workers);
 
-            /* Decrementing the active socket count allows the loop to
-             * terminate early if all active sockets have been processed.
-             */
-            --active;
-
-            /* 
-             * We are only polling for input, so any other event flags set will
-             * be relating to error events.
-             */
-            if (!(pfd->revents & POLLIN)) {
-                close_connection(pfd, timer);
                 continue;
             }
+        } else if (sigwait(&signals, &sig)) {
+            sig = -1;
+        }
 
-            /*
-             * The 0th index is reserved for the master socket. Any read event
-             * here will be for incoming connection requests.
-             */
-            if (i == 0U) {
-                accept_connection(pfds, timers);
-                continue;
-            }
+        if (sig < 0) {
+            perror("Failed to wait for signals");
+            status = 1;
+            break;
+        }
 
-            /* 
-             * Else: there is data to be received from a client. We reset their
-             * read timeout.
-             */
-            if (arm_timer(timer)) {
-                close_connection(pfd, timer);
-                continue;
-            }
+        if (sig == SIGINT)
+            break;
 
-            /* Read the client's data. Save the final byte for a null
-             * terminator.
-             */
-            ret = recv(pfd->fd, buffer, BUFFER_SIZE - 1U, 0);
+        workers_report(workers);
+    }
 
-            if (ret == 0) {
-                fprintf(stderr, "Client %zu disconnected\n", i);
-                close_connection(pfd, timer);
-                continue;
-            } else if (ret < 0) {
-                /* Since we are using signals to handle timeouts, we will
-                 * explicitly handle EINTR. Other graceful error handling can
-                 * also be made.
-                 */
-                if (errno == EINTR)
-                    continue;
-
-                fprintf(stderr, "Failed read client %zu's data", i);
-                perror(NULL);
-                return 1;
-            }
+    return workers_stop(workers) | status;
+}
 
-            /* Ensure null-byte termination of the buffer. */
-            buffer[ret] = '\0';
-            printf("[Client %zu] %s\n", i, buffer);
-        }
+
+int main(int argc, char **argv) {
+    int exit_status;
+    struct server_options opts;
+    struct server server;
+    struct timer_engine *timers;
+
+    if (parse_options(argc, argv, &opts)) {
+        free(opts.cpus);
+        return EXIT_FAILURE;
     }
-}
 
+    /* Each worker runs its own event loop. */
+    if (opts.workers > 0U) {
+        exit_status = run_workers(&opts) ? EXIT_FAILURE : EXIT_SUCCESS;
+        free(opts.cpus);
 
-int main(void) {
-    int exit_status = EXIT_SUCCESS;
+        report_usage();
+        fprintf(stderr, "Server shut down\n");
+        return exit_status;
+    }
 
-    struct pollfd pfds[MAX_CONNECTIONS];
-    timer_t timers[MAX_CONNECTIONS];
-    
-    /* Initialise the pollfd array (stores socket numbers and event flags for
-     * polling I/O) and timers array (maintains timeout timers for each client
-     * connection).
+    /* Initialise the timer engine (maintains timeout timers for each client
+     * connection), the listening socket and the server's connection table.
      */
-    if (initialise_server(pfds, timers, MAX_CONNECTIONS))
+    if (initialise_server(&server, &timers, &opts))
         return EXIT_FAILURE;
 
     /* Enter the main event loop. */
-    exit_status = event_loop(pfds, timers, MAX_CONNECTIONS) ? EXIT_FAILURE : EXIT_SUCCESS;
+    exit_status = event_loop(&server) ? EXIT_FAILURE : EXIT_SUCCESS;
 
     /* Close all connections and destroy the timers. */
-    shutdown_server(pfds, timers, MAX_CONNECTIONS);
+    shutdown_server(&server, timers);
     return exit_status;
-}
\ No newline at end of file
+}
@@ -0,0 +1,374 @@
+/* For eventfd(). */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/filter.h>
+#include <sys/eventfd.h>
+#endif
+
+#include "sockets.h"
+
+
+static const uint64_t NSEC_PER_SEC = 1000000000U;
+static const uint64_t NSEC_PER_MSEC = 1000000U;
+
+
+static uint64_t now_ns(void);
+static uint64_t socket_now(void *ctx);
+static int socket_wait(void *ctx, struct pollfd *pfds, size_t n, uint64_t deadline, size_t *ready);
+static int socket_accept(void *ctx, int listener, size_t i);
+static ssize_t socket_recv(void *ctx, int handle, void *buf, size_t n);
+static ssize_t socket_send(void *ctx, int handle, const void *buf, size_t n);
+static void socket_close(void *ctx, int handle);
+
+static int steer_connections(int listener, const struct server_options *opts);
+
+
+const struct server_backend SOCKET_BACKEND = {
+    .ctx = NULL,
+    .now = socket_now,
+    .wait = socket_wait,
+    .accept = socket_accept,
+    .recv = socket_recv,
+    .send = socket_send,
+    .close = socket_close
+};
+
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        perror("Failed to read the clock");
+        exit(EXIT_FAILURE);
+    }
+
+    return (uint64_t) ts.tv_sec * NSEC_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+
+static uint64_t socket_now(void *ctx) {
+    (void) ctx;
+    return now_ns();
+}
+
+
+static int socket_wait(void *ctx, struct pollfd *pfds, size_t n, uint64_t deadline, size_t *ready) {
+    int timeout = -1;
+    int active;
+    size_t count = 0U;
+
+    (void) ctx;
+
+    /* Round up, so as not to wake just before the deadline and wait again. */
+    if (deadline != UINT64_MAX) {
+        uint64_t now = now_ns();
+        uint64_t ms = deadline > now ? (deadline - now + NSEC_PER_MSEC - 1U) / NSEC_PER_MSEC : 0U;
+
+        timeout = ms > (uint64_t) INT_MAX ? INT_MAX : (int) ms;
+    }
+
+    /* Poll sockets for any activity, and the wakeup pipe of a worker. */
+    active = poll(pfds, (nfds_t) (pfds[n].fd >= 0 ? n + 1U : n), timeout);
+
+    if (active < 0)
+        return -1;
+
+    /* A wakeup only needs to end the wait. */
+    if (pfds[n].fd >= 0 && pfds[n].revents) {
+        drain_wakeup(pfds[n].fd);
+        --active;
+    }
+
+    /* Stop looking once all active sockets have been found. */
+    for (size_t i = 0U; i < n && count < (size_t) active; ++i) {
+        if (pfds[i].fd >= 0 && pfds[i].revents)
+            ready[count++] = i;
+    }
+
+    return (int) count;
+}
+
+
+static int socket_accept(void *ctx, int listener, size_t i) {
+    (void) ctx;
+    (void) i;
+    return accept(listener, NULL, NULL);
+}
+
+
+static ssize_t socket_recv(void *ctx, int handle, void *buf, size_t n) {
+    (void) ctx;
+    return recv(handle, buf, n, 0);
+}
+
+
+static ssize_t socket_send(void *ctx, int handle, const void *buf, size_t n) {
+    (void) ctx;
+    return send(handle, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+
+static void socket_close(void *ctx, int handle) {
+    (void) ctx;
+    close(handle);
+}
+
+
+int raise_file_limit(size_t n) {
+    /* Leave headroom for stdio and the capture file. */
+    const rlim_t wanted = (rlim_t) n + 16U;
+
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit)) {
+        perror("Failed to get the file descriptor limit");
+        return 1;
+    }
+
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < wanted) {
+        limit.rlim_cur = (limit.rlim_max != RLIM_INFINITY && limit.rlim_max < wanted) ? limit.rlim_max : wanted;
+
+        if (setrlimit(RLIMIT_NOFILE, &limit)) {
+            perror("Failed to raise the file descriptor limit");
+            return 1;
+        }
+
+        if (limit.rlim_cur < wanted) {
+            fprintf(stderr, "File descriptor limit is %ju, some connections will fail\n", (uintmax_t) limit.rlim_cur);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+static int steer_connections(int listener, const struct server_options *opts) {
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    /* The program loads the CPU that received the connection and returns
+     * the index of its worker's socket in the port's group, which is the
+     * order they were created in. Any other CPU gets an index past the
+     * end, for which the kernel falls back to hashing.
+     */
+    size_t length = 2U * opts->workers + 2U;
+    struct sock_filter *code = malloc(length * sizeof(*code));
+    struct sock_fprog prog = {
+        .len = (unsigned short) length,
+        .filter = code
+    };
+
+    size_t pc = 0U;
+    int err;
+
+    if (!code) {
+        perror("Failed to allocate the steering program");
+        return 1;
+    }
+
+    code[pc++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t) (SKF_AD_OFF + SKF_AD_CPU));
+
+    for (size_t i = 0U; i < opts->workers; ++i) {
+        code[pc++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t) opts->cpus[i], 0, 1);
+        code[pc++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, (uint32_t) i);
+    }
+
+    code[pc++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, (uint32_t) opts->workers);
+
+    err = setsockopt(listener, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, (const void *) &prog, (socklen_t) sizeof(prog));
+
+    if (err)
+        perror("Failed to attach the steering program");
+
+    free(code);
+    return err ? 1 : 0;
+#else
+    (void) listener;
+    (void) opts;
+    fprintf(stderr, "Steering connections needs SO_ATTACH_REUSEPORT_CBPF, which this system lacks\n");
+    return 1;
+#endif
+}
+
+
+int initialise_listening_socket(int *listener, const struct server_options *opts, int cpu) {
+    const int SOCK_OPT = 1;
+
+    int flags;
+
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+        .sin_port = htons(opts->port)
+    };
+
+    /* Create server's master socket. */
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (s < 0) {
+        perror("Failed to create socket");
+        return 1;
+    }
+
+    /* Allow rebinding of the listening address and port. */
+    if (setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const void *) &SOCK_OPT, (socklen_t) sizeof(SOCK_OPT))) {
+        perror("Failed to set socket for reuse");
+        close(s);
+        return 1;
+    }
+
+    /* Have reads on client sockets, which take the option from the listening
+     * socket, busy poll the device queue rather than sleep. Raising it above
+     * net.core.busy_read needs CAP_NET_ADMIN.
+     */
+    if (opts->busy_poll > 0) {
+#ifdef SO_BUSY_POLL
+        if (setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, (const void *) &opts->busy_poll, (socklen_t) sizeof(opts->busy_poll)))
+            perror("Failed to set the socket's busy poll time");
+#else
+        fprintf(stderr, "Busy polling is not supported here\n");
+#endif
+    }
+
+    /* Every worker listens on the port with its own socket, and the kernel
+     * shares connections out between them.
+     */
+    if (opts->workers > 0U) {
+#ifdef SO_REUSEPORT
+        if (setsockopt(s, SOL_SOCKET, SO_REUSEPORT, (const void *) &SOCK_OPT, (socklen_t) sizeof(SOCK_OPT))) {
+            perror("Failed to set socket for port sharing");
+            close(s);
+            return 1;
+        }
+#else
+        fprintf(stderr, "Workers need SO_REUSEPORT, which this system lacks\n");
+        close(s);
+        return 1;
+#endif
+
+#ifdef SO_INCOMING_CPU
+        /* Prefer this worker's socket for connections whose packets arrive
+         * on its CPU, so that they are handled where they are received.
+         */
+        if (setsockopt(s, SOL_SOCKET, SO_INCOMING_CPU, (const void *) &cpu, (socklen_t) sizeof(cpu)))
+            perror("Failed to set the socket's incoming CPU");
+#else
+        (void) cpu;
+#endif
+    }
+
+    /* Set the socket's O_NONBLOCK flag so its I/O is nonblocking. */
+    flags = fcntl(s, F_GETFL, 0);
+
+    if (flags == -1) {
+        perror("Failed to get socket flags");
+        close(s);
+        return 1;
+    }
+
+    if (fcntl(s, F_SETFL, flags | O_NONBLOCK)) {
+        perror("Failed to set socket to nonblocking mode");
+        close(s);
+        return 1;
+    }
+
+    /* Bind the socket to its address. */
+    if (bind(s, (struct sockaddr *) &addr, (socklen_t) sizeof(addr))) {
+        perror("Failed to bind socket");
+        close(s);
+        return 1;
+    }
+
+    /* Set socket to listen. */
+    if (listen(s, (int) (opts->max_connections - 1U))) {
+        perror("Failed to set socket to a listening state");
+        close(s);
+        return 1;
+    }
+
+    /* The program belongs to the port's group, which a socket only joins
+     * once bound, so it is attached again with each worker's socket, each
+     * time replacing it with the same one.
+     */
+    if (opts->steer && steer_connections(s, opts)) {
+        close(s);
+        return 1;
+    }
+
+    *listener = s;
+    return 0;
+}
+
+
+int open_wakeup(int wakeup[2]) {
+#ifdef __linux__
+    int fd = eventfd(0U, EFD_NONBLOCK);
+
+    if (fd < 0) {
+        perror("Failed to create wakeup");
+        return 1;
+    }
+
+    wakeup[0] = fd;
+    wakeup[1] = fd;
+#else
+    if (pipe(wakeup)) {
+        perror("Failed to create wakeup");
+        return 1;
+    }
+
+    if (fcntl(wakeup[0], F_SETFL, O_NONBLOCK) || fcntl(wakeup[1], F_SETFL, O_NONBLOCK)) {
+        perror("Failed to set wakeup to nonblocking mode");
+        close_wakeup(wakeup);
+        return 1;
+    }
+#endif
+
+    return 0;
+}
+
+
+void send_wakeup(int wakeup[2]) {
+    const uint64_t one = 1U;
+
+    /* A full wakeup is already pending. */
+    if (write(wakeup[1], &one, sizeof(one)) < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("Failed to send wakeup");
+}
+
+
+void drain_wakeup(int fd) {
+    uint64_t buf[8];
+
+    while (read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+
+void close_wakeup(int wakeup[2]) {
+    if (wakeup[0] >= 0)
+        close(wakeup[0]);
+
+    if (wakeup[1] >= 0 && wakeup[1] != wakeup[0])
+        close(wakeup[1]);
+
+    wakeup[0] = -1;
+    wakeup[1] = -1;
+}
@@ -0,0 +1,41 @@
+#ifndef SOCKETS_H
+#define SOCKETS_H
+
+#include <stddef.h>
+
+#include "timeout_server.h"
+
+
+/* The server on real sockets: the backend, the listening socket, and the
+ * wakeups by which threads end each other's waits.
+ */
+
+
+/* Real sockets on the monotonic clock. A wakeup's read end put in the entry
+ * after the slots is drained whenever it ends a wait.
+ */
+extern const struct server_backend SOCKET_BACKEND;
+
+/* Create a nonblocking socket listening on the options' port. With workers,
+ * it shares the port with theirs, preferring connections received on the
+ * given CPU (-1 for none), and steered by CPU if the options ask. Returns 1
+ * on failure.
+ */
+int initialise_listening_socket(int *listener, const struct server_options *opts, int cpu);
+
+/* Raise the file descriptor limit to allow n connections, as far as the hard
+ * limit allows. Returns 1 if it does not.
+ */
+int raise_file_limit(size_t n);
+
+/* Wakeups between threads: an eventfd where there is one, otherwise a pipe,
+ * read from wakeup[0] and written to wakeup[1]. Both ends are nonblocking,
+ * so that the woken side can drain it and the waking side never waits on
+ * it.
+ */
+int open_wakeup(int wakeup[2]);
+void send_wakeup(int wakeup[2]);
+void drain_wakeup(int fd);
+void close_wakeup(int wakeup[2]);
+
+#endif
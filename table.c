@@ -0,0 +1,179 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "table.h"
+
+
+#ifdef MAP_HUGETLB
+/* Size of the huge pages asked for with MAP_HUGETLB, the default on x86-64
+ * and most arm64 kernels. Where the default differs, the mapping fails and
+ * transparent huge pages are used instead.
+ */
+static const size_t HUGE_PAGE_SIZE = 2U * 1024U * 1024U;
+#endif
+
+/* Space kept in front of each table for its header, a cache line so that the
+ * table itself stays aligned.
+ */
+enum {
+    HEADER_SIZE = 64
+};
+
+
+/* Kept in front of each table, recording how to free it. */
+struct table_header {
+    /* Bytes allocated, including the header. */
+    size_t length;
+
+    /* Whether the table was mapped rather than allocated with calloc(), and
+     * whether it is locked in memory.
+     */
+    bool mapped;
+    bool locked;
+};
+
+
+#ifdef MAP_ANONYMOUS
+static size_t round_up(size_t size, size_t multiple);
+#endif
+
+static void *map_table(size_t *length, unsigned flags, const char *name);
+
+
+#ifdef MAP_ANONYMOUS
+static size_t round_up(size_t size, size_t multiple) {
+    return (size + multiple - 1U) / multiple * multiple;
+}
+#endif
+
+
+static void *map_table(size_t *length, unsigned flags, const char *name) {
+    /* Falling back is said once, not for every table. */
+    static bool warned = false;
+
+#ifdef MAP_ANONYMOUS
+    const size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+    void *table;
+
+#ifdef MAP_HUGETLB
+    if (flags & TABLE_HUGE_PAGES) {
+        size_t huge_length = round_up(*length, HUGE_PAGE_SIZE);
+
+        table = mmap(NULL, huge_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (table != MAP_FAILED) {
+            *length = huge_length;
+            return table;
+        }
+
+        /* Huge pages have to be reserved (vm.nr_hugepages) beforehand, so
+         * their absence is the usual case.
+         */
+        if (!warned)
+            fprintf(stderr, "No huge pages for the %s, trying transparent huge pages\n", name);
+
+        warned = true;
+    }
+#endif
+
+    *length = round_up(*length, page_size);
+    table = mmap(NULL, *length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (table == MAP_FAILED)
+        return NULL;
+
+#ifdef MADV_HUGEPAGE
+    /* Only a hint: without transparent huge pages, normal pages it is. */
+    if ((flags & TABLE_HUGE_PAGES) && madvise(table, *length, MADV_HUGEPAGE) && !warned) {
+        fprintf(stderr, "No transparent huge pages for the %s, using normal pages\n", name);
+        warned = true;
+    }
+#else
+    if ((flags & TABLE_HUGE_PAGES) && !warned) {
+        fprintf(stderr, "No huge pages on this system for the %s, using normal pages\n", name);
+        warned = true;
+    }
+#endif
+
+    return table;
+#else
+    (void) length;
+    (void) flags;
+    (void) name;
+    return NULL;
+#endif
+}
+
+
+void *table_alloc(size_t size, unsigned flags, const char *name) {
+    struct table_header header = {
+        .length = size + HEADER_SIZE,
+        .mapped = false,
+        .locked = false
+    };
+
+    char *table = NULL;
+
+    if (flags) {
+        table = map_table(&header.length, flags, name);
+        header.mapped = table != NULL;
+    }
+
+    /* Without flags, or without anonymous mappings, plain memory will do. */
+    if (!table)
+        table = calloc(1U, header.length);
+
+    if (!table) {
+        fprintf(stderr, "Failed to allocate the %s", name);
+        perror(NULL);
+        return NULL;
+    }
+
+    /* Locking needs a high enough RLIMIT_MEMLOCK (or CAP_IPC_LOCK), which is
+     * no reason not to run.
+     */
+    if (flags & TABLE_LOCKED) {
+        header.locked = !mlock(table, header.length);
+
+        if (!header.locked) {
+            fprintf(stderr, "Failed to lock the %s in memory", name);
+            perror(NULL);
+        }
+    }
+
+    *(struct table_header *) table = header;
+    return table + HEADER_SIZE;
+}
+
+
+size_t table_size(const void *table) {
+    const struct table_header *header = (const struct table_header *) ((const char *) table - HEADER_SIZE);
+
+    return header->length;
+}
+
+
+void table_free(void *table) {
+    struct table_header *header;
+
+    if (!table)
+        return;
+
+    header = (struct table_header *) ((char *) table - HEADER_SIZE);
+
+    /* Unmapping unlocks too. */
+    if (header->mapped) {
+        munmap(header, header->length);
+        return;
+    }
+
+    if (header->locked)
+        munlock(header, header->length);
+
+    free(header);
+}
@@ -0,0 +1,34 @@
+#ifndef TABLE_H
+#define TABLE_H
+
+#include <stddef.h>
+
+
+/* Allocation of the large per-slot tables: the connection table and the timer
+ * engines' arrays. These are touched on every event and timeout check, so at
+ * millions of slots they are worth keeping on huge pages and out of swap.
+ */
+
+enum table_flags {
+    /* Back the table with huge pages, falling back to transparent huge pages
+     * and then to normal pages.
+     */
+    TABLE_HUGE_PAGES = 1U << 0,
+
+    /* Lock the table in memory so that it is never paged out. */
+    TABLE_LOCKED = 1U << 1
+};
+
+/* Allocate a zeroed table of size bytes, described by name in any warnings.
+ * Returns NULL on failure.
+ */
+void *table_alloc(size_t size, unsigned flags, const char *name);
+
+/* Bytes actually taken by a table, which is rounded up to whole pages when
+ * it was allocated with any flags.
+ */
+size_t table_size(const void *table);
+
+void table_free(void *table);
+
+#endif
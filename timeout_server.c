@@ -0,0 +1,1166 @@
+#include <errno.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+
+#include "capture.h"
+#include "table.h"
+#include "timeout_server.h"
+
+
+/* Size of the server's receive buffer, including allocation for a 1-byte null
+ * terminator (hence must be > 1).
+ */
+static const size_t BUFFER_SIZE = 1024U;
+
+/* Size of the buffer holding echoed frames that the client has not read yet.
+ * Reading from a client stops while less than BUFFER_SIZE of it is free, so it
+ * must be at least BUFFER_SIZE.
+ */
+static const size_t OUTPUT_BUFFER_SIZE = 2U * 1024U;
+
+/* Size of the buffer in front of the traffic capture file. */
+static const size_t CAPTURE_BUFFER_SIZE = 1024U * 1024U;
+
+static const uint64_t NSEC_PER_SEC = 1000000000U;
+static const uint64_t NSEC_PER_USEC = 1000U;
+
+/* Number of events the average gap between them is taken over, roughly. */
+static const uint64_t GAP_WEIGHT = 8U;
+
+/* The handler of a server given none. */
+static const struct server_handler NO_HANDLER = {
+    .ctx = NULL,
+    .on_connect = NULL,
+    .on_frame = NULL,
+    .on_timeout = NULL,
+    .on_close = NULL
+};
+
+
+static void server_log(const struct server *server, const char *format, ...);
+
+static int open_capture(struct server *server, const char *path);
+static void record_capture(struct server *server, size_t i, enum capture_type type, const char *data, size_t n);
+static void close_capture(struct server *server);
+
+static size_t memory_used(const struct server *server);
+static void *take_buffer(struct server *server, struct buffer_pool *pool, struct buffer_pool *other);
+static void give_buffer(struct buffer_pool *pool, void *buffer);
+static void drain_pool(struct buffer_pool *pool);
+static int acquire_buffers(struct server *server, size_t i);
+static int attach_buffers(struct server *server, size_t i);
+static void release_buffers(struct server *server, size_t i);
+static void pause_connection(struct server *server, size_t i);
+static void resume_connections(struct server *server);
+
+static void accept_connections(struct server *server);
+static void free_slot(struct server *server, size_t i);
+static void close_connection(struct server *server, size_t i);
+static void handle_frames(void *ctx, const struct frame_batch *batch);
+static void handle_frame(struct server *server, size_t i, const char *frame, size_t n);
+static void split_frames(struct server *server, size_t i);
+static int send_ack(struct server *server, size_t i);
+static int send_output(struct server *server, size_t i);
+static void handle_events(struct server *server, size_t i);
+static int wait_for_events(struct server *server, uint64_t deadline);
+
+
+static void server_log(const struct server *server, const char *format, ...) {
+    va_list args;
+
+    if (!server->log)
+        return;
+
+    /* Keep the line in one piece among other threads' output. */
+    flockfile(server->log);
+
+    if (server->name)
+        fprintf(server->log, "[%s] ", server->name);
+
+    va_start(args, format);
+    vfprintf(server->log, format, args);
+    va_end(args);
+
+    funlockfile(server->log);
+}
+
+
+static int open_capture(struct server *server, const char *path) {
+    FILE *capture = fopen(path, "wb");
+
+    if (!capture) {
+        fprintf(stderr, "Failed to open capture file '%s'", path);
+        perror(NULL);
+        return 1;
+    }
+
+    /* Records are small, so buffer them up into large writes. */
+    if (setvbuf(capture, NULL, _IOFBF, CAPTURE_BUFFER_SIZE) || fwrite(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC), 1U, capture) != 1U) {
+        perror("Failed to initialise capture file");
+        fclose(capture);
+        return 1;
+    }
+
+    server->capture = capture;
+    server->capture_start = server->backend->now(server->backend->ctx);
+    return 0;
+}
+
+
+static void record_capture(struct server *server, size_t i, enum capture_type type, const char *data, size_t n) {
+    unsigned char header[CAPTURE_HEADER_SIZE];
+
+    struct capture_record record = {
+        .connection = (uint32_t) i,
+        .type = type,
+        .length = (uint32_t) n
+    };
+
+    if (!server->capture)
+        return;
+
+    record.time = server->backend->now(server->backend->ctx) - server->capture_start;
+    capture_encode(&record, header);
+
+    /* Failing to capture is no reason to stop serving clients. */
+    if (fwrite(header, sizeof(header), 1U, server->capture) != 1U || (n > 0U && fwrite(data, n, 1U, server->capture) != 1U)) {
+        perror("Failed to write capture file, capture stopped");
+        fclose(server->capture);
+        server->capture = NULL;
+    }
+}
+
+
+static void close_capture(struct server *server) {
+    if (!server->capture)
+        return;
+
+    if (fclose(server->capture))
+        perror("Failed to close capture file");
+
+    server->capture = NULL;
+}
+
+
+static size_t memory_used(const struct server *server) {
+    return server->fixed_memory + server->buffers.allocated * server->buffers.size + server->out_buffers.allocated * server->out_buffers.size;
+}
+
+
+static void *take_buffer(struct server *server, struct buffer_pool *pool, struct buffer_pool *other) {
+    const size_t budget = server->opts->memory_budget;
+
+    void *buffer = pool->free;
+
+    if (buffer) {
+        memcpy(&pool->free, buffer, sizeof(pool->free));
+        ++pool->in_use;
+        return buffer;
+    }
+
+    /* Make room under the budget by shrinking the other pool, whose
+     * released buffers are no use here.
+     */
+    if (budget > 0U && memory_used(server) + pool->size > budget) {
+        drain_pool(other);
+
+        if (memory_used(server) + pool->size > budget)
+            return NULL;
+    }
+
+    buffer = malloc(pool->size);
+
+    if (!buffer) {
+        perror("Failed to allocate a buffer");
+        return NULL;
+    }
+
+    ++pool->allocated;
+    ++pool->in_use;
+    return buffer;
+}
+
+
+static void give_buffer(struct buffer_pool *pool, void *buffer) {
+    memcpy(buffer, &pool->free, sizeof(pool->free));
+    pool->free = buffer;
+    --pool->in_use;
+}
+
+
+static void drain_pool(struct buffer_pool *pool) {
+    while (pool->free) {
+        void *buffer = pool->free;
+
+        memcpy(&pool->free, buffer, sizeof(pool->free));
+        free(buffer);
+        --pool->allocated;
+    }
+}
+
+
+static int acquire_buffers(struct server *server, size_t i) {
+    struct connection *conn = &server->conns[i];
+
+    if (!conn->buffer && !(conn->buffer = take_buffer(server, &server->buffers, &server->out_buffers)))
+        return 1;
+
+    if (server->opts->echo && !conn->out && !(conn->out = take_buffer(server, &server->out_buffers, &server->buffers)))
+        return 1;
+
+    return 0;
+}
+
+
+/* Buffers for a connection migrated in with len and out_len bytes buffered.
+ * Only data buffered needs a buffer, and output, whether echoes or replies
+ * from server_send(), needs one whatever the mode.
+ */
+static int attach_buffers(struct server *server, size_t i) {
+    struct connection *conn = &server->conns[i];
+
+    if (conn->len > 0U && !(conn->buffer = take_buffer(server, &server->buffers, &server->out_buffers)))
+        return 1;
+
+    if (conn->out_len > 0U && !(conn->out = take_buffer(server, &server->out_buffers, &server->buffers)))
+        return 1;
+
+    return 0;
+}
+
+
+static void release_buffers(struct server *server, size_t i) {
+    struct connection *conn = &server->conns[i];
+
+    /* A connection with no partial frame or pending echo is idle, and
+     * hibernates without buffers until it next has data.
+     */
+    if (conn->buffer && conn->len == 0U) {
+        give_buffer(&server->buffers, conn->buffer);
+        conn->buffer = NULL;
+    }
+
+    if (conn->out && conn->out_len == 0U) {
+        give_buffer(&server->out_buffers, conn->out);
+        conn->out = NULL;
+    }
+}
+
+
+static void pause_connection(struct server *server, size_t i) {
+    struct connection *conn = &server->conns[i];
+
+    release_buffers(server, i);
+    server->pfds[i].events &= (short) ~POLLIN;
+
+    if (!conn->paused) {
+        conn->paused = true;
+        server->paused[server->n_paused++] = i;
+    }
+}
+
+
+static void resume_connections(struct server *server) {
+    const size_t budget = server->opts->memory_budget;
+    const size_t needed = server->buffers.size + (server->opts->echo ? server->out_buffers.size : 0U);
+
+    size_t used = memory_used(server);
+
+    /* Resume as many paused connections as there are buffers for, counting
+     * pooled buffers and those the budget allows to be allocated.
+     */
+    size_t spare = server->buffers.allocated - server->buffers.in_use;
+
+    if (used < budget)
+        spare += (budget - used) / needed;
+
+    while (server->n_paused > 0U && spare > 0U) {
+        size_t i = server->paused[--server->n_paused];
+        struct connection *conn = &server->conns[i];
+
+        /* An echo client still too far behind is resumed by send_output()
+         * once it catches up.
+         */
+        conn->paused = false;
+        if (OUTPUT_BUFFER_SIZE - conn->out_len >= BUFFER_SIZE && !conn->closing)
+            server->pfds[i].events |= POLLIN;
+
+        --spare;
+    }
+
+    /* New connections would only be paused too. */
+    if (server->pfds[0].fd >= 0)
+        server->pfds[0].events = server->n_paused > 0U ? 0 : POLLIN;
+}
+
+
+static void accept_connections(struct server *server) {
+    const struct server_backend *backend = server->backend;
+
+    /* Take every pending connection request, so that a burst of them costs
+     * one wait rather than one each.
+     */
+    while (1) {
+        size_t i = server->n_free > 0U ? server->free_slots[server->n_free - 1U] : SIZE_MAX;
+        struct pollfd *pfd;
+        struct connection *conn;
+        uint64_t now;
+
+        int s = backend->accept(backend->ctx, server->pfds[0].fd, i);
+
+        if (s < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("Failed to accept connection request");
+
+            return;
+        }
+
+        if (i == SIZE_MAX) {
+            server_log(server, "Too many connections already accepted\n");
+            backend->close(backend->ctx, s);
+            continue;
+        }
+
+        --server->n_free;
+        pfd = &server->pfds[i];
+        conn = &server->conns[i];
+
+        pfd->fd = s;
+        pfd->events = POLLIN;
+        conn->len = 0U;
+        conn->frames = 0U;
+        conn->acked = 0U;
+        conn->ack_sent = ACK_SIZE;
+        conn->out_len = 0U;
+        conn->paused = false;
+        conn->closing = false;
+        conn->id = ++server->last_id;
+
+        /* Arm the client's timeout timer. */
+        now = backend->now(backend->ctx);
+        conn->deadline = now + server->timeout;
+
+        if (server->timers->arm(server->timers, i, now, server->timeout)) {
+            backend->close(backend->ctx, s);
+            free_slot(server, i);
+            continue;
+        }
+
+        server_log(server, "Client %zu connected\n", i);
+        record_capture(server, i, CAPTURE_CONNECT, NULL, 0U);
+
+        if (server->handler->on_connect)
+            server->handler->on_connect(server->handler->ctx, server, i);
+    }
+}
+
+
+/* Frees everything slot i holds but its handle, without telling the
+ * handler.
+ */
+static void free_slot(struct server *server, size_t i) {
+    struct connection *conn = &server->conns[i];
+
+    conn->len = 0U;
+    conn->out_len = 0U;
+    release_buffers(server, i);
+
+    if (conn->paused) {
+        for (size_t k = 0U; k < server->n_paused; ++k) {
+            if (server->paused[k] == i) {
+                server->paused[k] = server->paused[--server->n_paused];
+                break;
+            }
+        }
+
+        conn->paused = false;
+    }
+
+    server->timers->disarm(server->timers, i);
+    server->pfds[i].fd = -1;
+
+    /* The listening socket's slot is never reused. */
+    if (i != 0U)
+        server->free_slots[server->n_free++] = i;
+}
+
+
+static void close_connection(struct server *server, size_t i) {
+    struct pollfd *pfd = &server->pfds[i];
+
+    if (pfd->fd < 0)
+        return;
+
+    if (i != 0U && server->handler->on_close)
+        server->handler->on_close(server->handler->ctx, server, i);
+
+    server->backend->close(server->backend->ctx, pfd->fd);
+    free_slot(server, i);
+}
+
+
+/* Hands on a batch from the pipeline, on one of its threads. */
+static void handle_frames(void *ctx, const struct frame_batch *batch) {
+    struct server *server = ctx;
+    const struct server_handler *handler = server->handler;
+
+    for (size_t k = 0U; k < batch->count; ++k)
+        handler->on_frame(handler->ctx, server, batch->frames[k].slot, batch->frames[k].id, batch->data + batch->frames[k].offset, batch->frames[k].len);
+}
+
+
+static void handle_frame(struct server *server, size_t i, const char *frame, size_t n) {
+    struct connection *conn = &server->conns[i];
+
+    record_capture(server, i, CAPTURE_FRAME, frame, n);
+
+    if (conn->closing)
+        return;
+
+    /* Echo the frame, newline and all. Reads stop before the output buffer
+     * gets too full for it, so there is always room.
+     */
+    if (server->opts->echo) {
+        memcpy(conn->out + conn->out_len, frame, n);
+        conn->out[conn->out_len + n] = '\n';
+        conn->out_len += n + 1U;
+        return;
+    }
+
+    /* Empty frames are heartbeats, only there to keep the connection
+     * alive.
+     */
+    if (n == 0U || !server->handler->on_frame)
+        return;
+
+    /* Handed on with the rest of the loop's frames once it has handled every
+     * event.
+     */
+    if (server->pipeline) {
+        pipeline_add(server->pipeline, i, conn->id, frame, n);
+        return;
+    }
+
+    server->handler->on_frame(server->handler->ctx, server, i, conn->id, frame, n);
+}
+
+
+static void split_frames(struct server *server, size_t i) {
+    struct connection *conn = &server->conns[i];
+
+    char *start = conn->buffer;
+    char *end = conn->buffer + conn->len;
+    char *newline;
+
+    /* Hand on every complete frame, replacing its newline with a null
+     * terminator.
+     */
+    while ((newline = memchr(start, '\n', (size_t) (end - start)))) {
+        *newline = '\0';
+        handle_frame(server, i, start, (size_t) (newline - start));
+        ++conn->frames;
+        start = newline + 1;
+    }
+
+    conn->len = (size_t) (end - start);
+
+    /* A frame too long for the buffer is handed on in pieces. */
+    if (conn->len == BUFFER_SIZE - 1U) {
+        *end = '\0';
+        handle_frame(server, i, start, conn->len);
+        ++conn->frames;
+        conn->len = 0U;
+    }
+
+    /* Keep the partial frame at the front of the buffer for the next read. */
+    memmove(conn->buffer, start, conn->len);
+}
+
+
+static int send_ack(struct server *server, size_t i) {
+    const struct server_backend *backend = server->backend;
+
+    struct pollfd *pfd = &server->pfds[i];
+    struct connection *conn = &server->conns[i];
+
+    /* One acknowledgement covers every frame received since the last, so a
+     * client sending faster than we can acknowledge gets fewer, larger
+     * acknowledgements rather than a growing backlog of them.
+     */
+    while (conn->ack_sent < ACK_SIZE || conn->acked < conn->frames) {
+        ssize_t ret;
+
+        if (conn->ack_sent == ACK_SIZE) {
+            conn->acked = conn->frames;
+            conn->ack_sent = 0U;
+
+            for (size_t j = 0U; j < ACK_SIZE; ++j)
+                conn->ack[j] = (unsigned char) (conn->acked >> (8U * (ACK_SIZE - 1U - j)));
+        }
+
+        ret = backend->send(backend->ctx, pfd->fd, conn->ack + conn->ack_sent, ACK_SIZE - conn->ack_sent);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            /* The client is not reading: finish when the socket drains. */
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                pfd->events |= POLLOUT;
+                return 0;
+            }
+
+            return 1;
+        }
+
+        conn->ack_sent += (size_t) ret;
+    }
+
+    /* A closing connection is closed on the next wait. */
+    if (!conn->closing)
+        pfd->events &= (short) ~POLLOUT;
+
+    return 0;
+}
+
+
+static int send_output(struct server *server, size_t i) {
+    const struct server_backend *backend = server->backend;
+
+    struct pollfd *pfd = &server->pfds[i];
+    struct connection *conn = &server->conns[i];
+
+    size_t sent = 0U;
+
+    while (sent < conn->out_len) {
+        ssize_t ret = backend->send(backend->ctx, pfd->fd, conn->out + sent, conn->out_len - sent);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+
+            return 1;
+        }
+
+        sent += (size_t) ret;
+    }
+
+    conn->out_len -= sent;
+    memmove(conn->out, conn->out + sent, conn->out_len);
+
+    /* Wait for the client to make room for whatever is left, and stop
+     * reading from a client that is not reading its output until there is
+     * room for another read's worth.
+     */
+    if (conn->out_len > 0U || conn->closing)
+        pfd->events |= POLLOUT;
+    else
+        pfd->events &= (short) ~POLLOUT;
+
+    if (OUTPUT_BUFFER_SIZE - conn->out_len < BUFFER_SIZE || conn->paused || conn->closing)
+        pfd->events &= (short) ~POLLIN;
+    else
+        pfd->events |= POLLIN;
+
+    return 0;
+}
+
+
+static void handle_events(struct server *server, size_t i) {
+    const struct server_options *opts = server->opts;
+    const struct server_backend *backend = server->backend;
+
+    struct pollfd *pfd = &server->pfds[i];
+    struct connection *conn = &server->conns[i];
+
+    ssize_t ret;
+    uint64_t now;
+
+    /* Skip slots closed since the wait. */
+    if (pfd->fd < 0)
+        return;
+
+    /*
+     * Besides input, we only poll for output while an acknowledgement or
+     * output is held up, so any other event flags set will be relating to
+     * error events.
+     */
+    if (!(pfd->revents & POLLIN) && (pfd->revents & (POLLERR | POLLHUP | POLLNVAL))) {
+        if (i != 0U)
+            record_capture(server, i, CAPTURE_CLOSE, NULL, 0U);
+
+        close_connection(server, i);
+        return;
+    }
+
+    /*
+     * The 0th index is reserved for the master socket. Any read event here
+     * will be for incoming connection requests.
+     */
+    if (i == 0U) {
+        accept_connections(server);
+        return;
+    }
+
+    /* The client has made room for a held-up acknowledgement or output. */
+    if (pfd->revents & POLLOUT) {
+        if (opts->ack ? send_ack(server, i) : send_output(server, i)) {
+            fprintf(stderr, "Failed to write to client %zu", i);
+            perror(NULL);
+            record_capture(server, i, CAPTURE_CLOSE, NULL, 0U);
+            close_connection(server, i);
+            return;
+        }
+
+        if (conn->closing && conn->out_len == 0U && conn->ack_sent == ACK_SIZE) {
+            server_log(server, "Client %zu closed\n", i);
+            record_capture(server, i, CAPTURE_CLOSE, NULL, 0U);
+            close_connection(server, i);
+            return;
+        }
+
+        release_buffers(server, i);
+
+        if (!(pfd->revents & POLLIN))
+            return;
+    }
+
+    /*
+     * Else: there is data to be received from a client. We reset their read
+     * timeout.
+     */
+    now = backend->now(backend->ctx);
+    conn->deadline = now + server->timeout;
+
+    if (server->timers->arm(server->timers, i, now, server->timeout)) {
+        close_connection(server, i);
+        return;
+    }
+
+    /* Leave the data unread until there is memory for it. */
+    if (acquire_buffers(server, i)) {
+        pause_connection(server, i);
+        return;
+    }
+
+    /* Read the client's data onto the end of any partial frame left from the
+     * last read. Save the final byte for a null terminator.
+     */
+    ret = backend->recv(backend->ctx, pfd->fd, conn->buffer + conn->len, BUFFER_SIZE - 1U - conn->len);
+
+    if (ret == 0) {
+        /* Hand on a final frame that was never terminated. */
+        if (conn->len > 0U) {
+            conn->buffer[conn->len] = '\0';
+            handle_frame(server, i, conn->buffer, conn->len);
+        }
+
+        server_log(server, "Client %zu disconnected\n", i);
+        record_capture(server, i, CAPTURE_CLOSE, NULL, 0U);
+        close_connection(server, i);
+        return;
+    } else if (ret < 0) {
+        /* Signals may interrupt the read, and readiness can be spurious.
+         * Either way, the next wait tells us whether there is still data.
+         */
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+            release_buffers(server, i);
+            return;
+        }
+
+        /* A client closing with acknowledgements still unread resets the
+         * connection, which is no reason to stop the server.
+         */
+        fprintf(stderr, "Failed read client %zu's data", i);
+        perror(NULL);
+        record_capture(server, i, CAPTURE_CLOSE, NULL, 0U);
+        close_connection(server, i);
+        return;
+    }
+
+    conn->len += (size_t) ret;
+    split_frames(server, i);
+
+    /* Write the frames' echoes, or whatever the handler sent in reply. */
+    if ((opts->echo || conn->out_len > 0U) && send_output(server, i)) {
+        fprintf(stderr, "Failed to write to client %zu", i);
+        perror(NULL);
+        record_capture(server, i, CAPTURE_CLOSE, NULL, 0U);
+        close_connection(server, i);
+        return;
+    }
+
+    /* Acknowledge once per read, however many frames it held. Write errors
+     * show up as a read error or hangup on the next wait.
+     */
+    if (opts->ack && conn->frames > conn->acked && conn->ack_sent == ACK_SIZE)
+        send_ack(server, i);
+
+    release_buffers(server, i);
+}
+
+
+int server_init(struct server *server, const struct server_options *opts, const struct server_backend *backend, const struct server_handler *handler, struct timer_engine *timers, int listener, volatile sig_atomic_t *interrupted) {
+    const size_t n = opts->max_connections;
+
+    char *tables;
+
+    *server = (struct server) {
+        .opts = opts,
+        .backend = backend,
+        .handler = handler ? handler : &NO_HANDLER,
+        .timers = timers,
+        .interrupted = interrupted,
+        .log = stderr,
+        .name = NULL,
+        .report = NULL,
+        .timeout = (uint64_t) opts->timeout.tv_sec * NSEC_PER_SEC + (uint64_t) opts->timeout.tv_nsec,
+        .max_spin = (uint64_t) opts->spin * NSEC_PER_USEC,
+        .gap = (uint64_t) opts->spin * NSEC_PER_USEC,
+        .n = n,
+        .buffers.size = BUFFER_SIZE,
+        .out_buffers.size = OUTPUT_BUFFER_SIZE
+    };
+
+    /* The connection limit is only known at run time, so the slot tables
+     * are allocated then, as one block: the connection array, the free,
+     * ready and paused slot lists and the pollfd array (with the backend's
+     * entry at the end), in decreasing order of alignment. Buffers are only
+     * allocated once connections need them.
+     */
+    tables = table_alloc(n * (sizeof(struct connection) + 3U * sizeof(size_t)) + (n + 1U) * sizeof(struct pollfd), opts->table_flags, "connection table");
+
+    if (!tables)
+        return 1;
+
+    server->conns = (struct connection *) tables;
+    server->free_slots = (size_t *) (server->conns + n);
+    server->ready = server->free_slots + n;
+    server->paused = server->ready + n;
+    server->pfds = (struct pollfd *) (server->paused + n);
+    server->fixed_memory = table_size(tables) + timers->memory;
+
+    /* Under a budget, at least one connection must be able to read. */
+    if (opts->memory_budget > 0U && server->fixed_memory + BUFFER_SIZE + (opts->echo ? OUTPUT_BUFFER_SIZE : 0U) > opts->memory_budget) {
+        fprintf(stderr, "Memory budget of %zu bytes is too small for %zu connection slots, which take %zu bytes before buffers\n",
+            opts->memory_budget, n, server->fixed_memory);
+        table_free(tables);
+        return 1;
+    }
+
+    /* Initialising the socket array (-1 is used in this program to denote an
+     * unused connection slot). Free slots are stacked so that the lowest is
+     * taken first.
+     */
+    for (size_t i = 0U; i <= n; ++i)
+        server->pfds[i].fd = -1;
+
+    for (size_t i = n - 1U; i > 0U; --i)
+        server->free_slots[server->n_free++] = i;
+
+    /* The first slot is reserved for the listening socket. Obviously, we will
+     * not arm a timer for it.
+     */
+    server->pfds[0].fd = listener;
+    server->pfds[0].events = POLLIN;
+
+    if (opts->capture_path) {
+        fprintf(stderr, "Opening capture file\n");
+        if (open_capture(server, opts->capture_path)) {
+            table_free(tables);
+            return 1;
+        }
+    }
+
+    /* With nothing to hand frames to, there is nothing for the threads to
+     * do.
+     */
+    if (opts->processors > 0U && server->handler->on_frame && !(server->pipeline = pipeline_create(opts->processors, handle_frames, server))) {
+        if (server->capture)
+            close_capture(server);
+
+        table_free(tables);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* Waits for events, spinning on the sockets with waits that return at once
+ * rather than blocking while events come often enough to be caught by it, to
+ * be there when they arrive rather than be woken for them. The gap between
+ * events is averaged over about the last GAP_WEIGHT of them, and the spin
+ * lasts up to twice that, within the budget, before giving up and blocking.
+ */
+static int wait_for_events(struct server *server, uint64_t deadline) {
+    const struct server_backend *backend = server->backend;
+    struct server_waits *waits = &server->waits;
+
+    uint64_t start, now;
+    int active = 0;
+    bool block = true;
+
+    if (server->max_spin == 0U)
+        return backend->wait(backend->ctx, server->pfds, server->n, deadline, server->ready);
+
+    start = backend->now(backend->ctx);
+    now = start;
+
+    if (server->gap < server->max_spin) {
+        const uint64_t spin = server->gap < server->max_spin / 2U ? 2U * server->gap : server->max_spin;
+
+        /* Stop for the deadline, and for signals, which a wait returning at
+         * once may not be interrupted by.
+         */
+        do {
+            active = backend->wait(backend->ctx, server->pfds, server->n, now, server->ready);
+            now = backend->now(backend->ctx);
+        } while (active == 0 && now - start < spin && now < deadline && !*server->interrupted && !(server->report && *server->report));
+
+        ++waits->spins;
+        waits->spinning += now - start;
+        waits->spin_hits += active > 0 ? 1U : 0U;
+
+        /* Only block once the spin has run out. */
+        block = active == 0 && now - start >= spin && now < deadline;
+        start = now;
+    }
+
+    if (block) {
+        ++waits->blocks;
+        active = backend->wait(backend->ctx, server->pfds, server->n, deadline, server->ready);
+        now = backend->now(backend->ctx);
+        waits->blocked += now - start;
+    }
+
+    /* A long quiet spell counts as no more than twice the budget, so that
+     * spinning resumes within a few events once they come often again.
+     */
+    if (active > 0) {
+        const uint64_t sample = now - server->last_event;
+
+        if (server->last_event > 0U)
+            server->gap = server->gap - server->gap / GAP_WEIGHT + (sample < 2U * server->max_spin ? sample : 2U * server->max_spin) / GAP_WEIGHT;
+
+        server->last_event = now;
+    }
+
+    return active;
+}
+
+
+int event_loop(struct server *server) {
+    const struct server_backend *backend = server->backend;
+    struct timer_engine *timers = server->timers;
+
+    /* Until an interrupt signal (Ctrl-C) is raised. */
+    while (!*server->interrupted) {
+        uint64_t now = backend->now(backend->ctx);
+        size_t i;
+        int active;
+
+        /* Asked for a memory report (SIGUSR2). */
+        if (server->report && *server->report) {
+            *server->report = 0;
+            server_report_memory(server, stderr);
+            server_report_waits(server, stderr);
+        }
+
+        /* Close every client whose timer has expired. This is done at the
+         * start of the loop so that a wait cut short by a timeout signal, or
+         * ending at the next deadline, is followed by the check.
+         */
+        while (timers->next_expired(timers, now, &i)) {
+            if (server->pfds[i].fd < 0)
+                continue;
+
+            server_log(server, "Client %zu timed out\n", i);
+            record_capture(server, i, CAPTURE_TIMEOUT, NULL, 0U);
+
+            if (server->handler->on_timeout)
+                server->handler->on_timeout(server->handler->ctx, server, i);
+
+            close_connection(server, i);
+        }
+
+        /* Timeouts may have freed memory for connections waiting on it. */
+        resume_connections(server);
+
+        /* Wait for activity on any socket, or the next timer to expire. */
+        active = wait_for_events(server, timers->next_deadline(timers));
+
+        if (active < 0) {
+            /* If the wait was interrupted by a signal (timer alarm or
+             * interrupt), we just continue. Other errors can also be handled
+             * gracefully
+             */
+            if (errno == EINTR)
+                continue;
+
+            perror("Failed to poll sockets");
+            return 0;
+        }
+
+        /* Handle each socket with events. Make sure to break if the user
+         * raises an interrupt signal too.
+         */
+        for (size_t k = 0U; k < (size_t) active && !*server->interrupted; ++k)
+            handle_events(server, server->ready[k]);
+
+        if (server->pipeline)
+            pipeline_flush(server->pipeline);
+    }
+
+    return 0;
+}
+
+
+void server_shutdown(struct server *server) {
+    server_log(server, "Closing all client connections\n");
+    for (size_t i = 0U; i < server->n; ++i)
+        close_connection(server, i);
+
+    /* Closing released every buffer to its pool. */
+    drain_pool(&server->buffers);
+    drain_pool(&server->out_buffers);
+
+    /* Hand on every frame read before going. */
+    pipeline_destroy(server->pipeline);
+    server->pipeline = NULL;
+
+    /* The slot tables were allocated as one block, starting with the
+     * connections.
+     */
+    table_free(server->conns);
+
+    if (server->capture) {
+        fprintf(stderr, "Closing capture file\n");
+        close_capture(server);
+    }
+}
+
+
+void server_memory(const struct server *server, struct server_memory *memory) {
+    const size_t n = server->n;
+    const size_t timers = server->timers->memory;
+
+    *memory = (struct server_memory) {
+        .tables = server->fixed_memory - timers,
+        .timers = timers,
+        .buffers = server->buffers.allocated * server->buffers.size,
+        .out_buffers = server->out_buffers.allocated * server->out_buffers.size,
+        .total = memory_used(server),
+        .per_slot = server->fixed_memory / n,
+        .per_reading_connection = server->buffers.size + (server->opts->echo ? server->out_buffers.size : 0U),
+        .connections = n - 1U - server->n_free,
+        .batches = server->pipeline ? pipeline_memory(server->pipeline) : 0U
+    };
+}
+
+
+void server_report_memory(const struct server *server, FILE *out) {
+    struct server_memory memory;
+
+    server_memory(server, &memory);
+
+    /* Kept together when several servers report at once. */
+    flockfile(out);
+
+    if (server->name)
+        fprintf(out, "[%s] ", server->name);
+
+    fprintf(out, "Memory: %zu bytes for %zu connections in %zu slots: %zu slot tables, %zu timers, %zu receive buffers (%zu in use), %zu output buffers (%zu in use)\n",
+        memory.total, memory.connections, server->n, memory.tables, memory.timers,
+        memory.buffers, server->buffers.in_use, memory.out_buffers, server->out_buffers.in_use);
+    if (server->name)
+        fprintf(out, "[%s] ", server->name);
+
+    fprintf(out, "Memory per connection: %zu bytes idle, %zu more while reading\n",
+        memory.per_slot, memory.per_reading_connection);
+
+    if (server->pipeline) {
+        if (server->name)
+            fprintf(out, "[%s] ", server->name);
+
+        fprintf(out, "Memory for processing: %zu bytes of frame batches\n", memory.batches);
+    }
+
+    if (server->opts->memory_budget > 0U) {
+        if (server->name)
+            fprintf(out, "[%s] ", server->name);
+
+        fprintf(out, "Memory budget: %zu bytes, %zu connections waiting for buffers\n", server->opts->memory_budget, server->n_paused);
+    }
+
+    funlockfile(out);
+}
+
+
+int server_send(struct server *server, size_t i, const char *data, size_t n) {
+    struct connection *conn = &server->conns[i];
+
+    if (server->opts->ack || n > OUTPUT_BUFFER_SIZE - conn->out_len)
+        return 1;
+
+    if (!conn->out && !(conn->out = take_buffer(server, &server->out_buffers, &server->buffers)))
+        return 1;
+
+    memcpy(conn->out + conn->out_len, data, n);
+    conn->out_len += n;
+
+    /* Written after the frames of the read being handled, if any, or else
+     * once the socket is next found writable.
+     */
+    server->pfds[i].events |= POLLOUT;
+    return 0;
+}
+
+
+void server_close(struct server *server, size_t i) {
+    struct connection *conn = &server->conns[i];
+
+    /* Closed from handle_events() once the socket is found writable, so
+     * that it never happens under a caller still using the slot.
+     */
+    conn->closing = true;
+    server->pfds[i].events = POLLOUT;
+}
+
+
+void server_report_waits(const struct server *server, FILE *out) {
+    const struct server_waits *waits = &server->waits;
+
+    /* Without spinning, the loop only blocks. */
+    if (server->max_spin == 0U)
+        return;
+
+    flockfile(out);
+
+    if (server->name)
+        fprintf(out, "[%s] ", server->name);
+
+    fprintf(out, "Waits: %.3f s spinning in %zu spins (%zu finding events), %.3f s blocked in %zu waits, %.1f us average gap between events\n",
+        (double) waits->spinning / (double) NSEC_PER_SEC, waits->spins, waits->spin_hits,
+        (double) waits->blocked / (double) NSEC_PER_SEC, waits->blocks, (double) server->gap / (double) NSEC_PER_USEC);
+
+    funlockfile(out);
+}
+
+
+struct migration *server_detach(struct server *server, size_t i) {
+    struct connection *conn = &server->conns[i];
+    struct migration *migration = malloc(sizeof(*migration) + conn->len + conn->out_len);
+
+    if (!migration) {
+        perror("Failed to allocate a migration");
+        return NULL;
+    }
+
+    *migration = (struct migration) {
+        .handle = server->pfds[i].fd,
+        .deadline = conn->deadline,
+        .frames = conn->frames,
+        .acked = conn->acked,
+        .ack_sent = conn->ack_sent,
+        .closing = conn->closing,
+        .len = conn->len,
+        .out_len = conn->out_len
+    };
+
+    memcpy(migration->ack, conn->ack, ACK_SIZE);
+
+    if (conn->len > 0U)
+        memcpy(migration->data, conn->buffer, conn->len);
+
+    if (conn->out_len > 0U)
+        memcpy(migration->data + conn->len, conn->out, conn->out_len);
+
+    server_log(server, "Client %zu migrated out\n", i);
+
+    if (server->handler->on_close)
+        server->handler->on_close(server->handler->ctx, server, i);
+
+    free_slot(server, i);
+    return migration;
+}
+
+
+int server_attach(struct server *server, struct migration *migration) {
+    const struct server_backend *backend = server->backend;
+    const uint64_t now = backend->now(backend->ctx);
+
+    struct pollfd *pfd;
+    struct connection *conn;
+    size_t i;
+
+    if (server->n_free == 0U) {
+        server_log(server, "No slot for a migrating client\n");
+        backend->close(backend->ctx, migration->handle);
+        free(migration);
+        return 1;
+    }
+
+    i = server->free_slots[--server->n_free];
+    pfd = &server->pfds[i];
+    conn = &server->conns[i];
+
+    pfd->fd = migration->handle;
+    pfd->events = POLLIN;
+    conn->len = migration->len;
+    conn->frames = migration->frames;
+    conn->acked = migration->acked;
+    memcpy(conn->ack, migration->ack, ACK_SIZE);
+    conn->ack_sent = migration->ack_sent;
+    conn->out_len = migration->out_len;
+    conn->paused = false;
+    conn->closing = migration->closing;
+    conn->id = ++server->last_id;
+    conn->deadline = migration->deadline;
+
+    if (attach_buffers(server, i)) {
+        server_log(server, "No memory for migrating client %zu\n", i);
+        backend->close(backend->ctx, migration->handle);
+        free(migration);
+        free_slot(server, i);
+        return 1;
+    }
+
+    if (conn->len > 0U)
+        memcpy(conn->buffer, migration->data, conn->len);
+
+    if (conn->out_len > 0U)
+        memcpy(conn->out, migration->data + conn->len, conn->out_len);
+
+    free(migration);
+
+    /* Keep the deadline it had, a timeout already due expiring at once. */
+    if (server->timers->arm(server->timers, i, now, conn->deadline > now ? conn->deadline - now : 1U)) {
+        backend->close(backend->ctx, pfd->fd);
+        free_slot(server, i);
+        return 1;
+    }
+
+    /* Carry on with any held up acknowledgement, output or close. */
+    if (conn->ack_sent < ACK_SIZE || conn->out_len > 0U || conn->closing)
+        pfd->events |= POLLOUT;
+
+    if (OUTPUT_BUFFER_SIZE - conn->out_len < BUFFER_SIZE || conn->closing)
+        pfd->events &= (short) ~POLLIN;
+
+    server_log(server, "Client %zu migrated in\n", i);
+
+    if (server->handler->on_connect)
+        server->handler->on_connect(server->handler->ctx, server, i);
+
+    return 0;
+}
@@ -0,0 +1,382 @@
+#ifndef TIMEOUT_SERVER_H
+#define TIMEOUT_SERVER_H
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <poll.h>
+#include <sys/types.h>
+
+#include "pipeline.h"
+#include "ring.h"
+#include "timer.h"
+
+
+/* The server's core: the connection table, framing, acknowledgements,
+ * echoes, timeouts and the event loop. It reaches the outside world only
+ * through a struct server_backend, so that it can be run against real
+ * sockets or a simulation, and hands what its clients send to a struct
+ * server_handler, so that it can be embedded in other programs.
+ */
+
+
+/* Acknowledgements are the frame count as a big-endian 64-bit integer. */
+enum {
+    ACK_SIZE = 8
+};
+
+/* Client timeout engines. */
+enum server_timers {
+    SERVER_TIMERS_POSIX,
+    SERVER_TIMERS_HEAP
+};
+
+/* Run configuration. */
+struct server_options {
+    size_t max_connections;
+    uint16_t port;
+    struct timespec timeout;
+    enum server_timers timers;
+
+    /* Traffic capture file, or NULL when not capturing. */
+    const char *capture_path;
+
+    /* Acknowledge received frames (see send_ack()). */
+    bool ack;
+
+    /* Echo each frame back to its sender instead of handing it on. */
+    bool echo;
+
+    /* Most memory the server may use for connections, in bytes, or 0 for no
+     * limit (see server_memory()).
+     */
+    size_t memory_budget;
+
+    /* How the slot tables are allocated (see table.h). */
+    unsigned table_flags;
+
+    /* CPUs to run a worker on each, every worker with its own listening
+     * socket, timer engine and slots, or no workers to run in the main
+     * thread.
+     */
+    int *cpus;
+    size_t workers;
+
+    /* Steer each connection to the worker on the CPU that received it. */
+    bool steer;
+
+    /* Most microseconds to spin on the sockets before blocking, or 0 to
+     * always block (see wait_for_events()), and the SO_BUSY_POLL time for
+     * client sockets, or 0 to leave it to the system.
+     */
+    size_t spin;
+    int busy_poll;
+
+    /* Accept every connection on one thread and hand each to the least
+     * loaded worker, rather than have the workers accept their own.
+     */
+    bool acceptor;
+
+    /* How often to even out the workers' connections by moving them from
+     * the busiest to the least busy, or zero never to.
+     */
+    struct timespec balance;
+
+    /* Threads to hand frames to the handler on, leaving the loop to read and
+     * split them, or 0 to hand them on in the loop. Frames reach the handler
+     * after the loop has moved on, so the connection may have closed and its
+     * slot been reused by then, and the handler cannot reply or close it,
+     * as server_send() and server_close() are the loop's alone.
+     */
+    size_t processors;
+};
+
+/* Per-connection state, held in an array parallel to the pollfd array and the
+ * timer engine's slots.
+ */
+struct connection {
+    /* Receive buffer of BUFFER_SIZE bytes, holding the start of a frame whose
+     * terminating newline has not arrived yet. Buffers are only held while
+     * in use, so an idle connection has none.
+     */
+    char *buffer;
+    size_t len;
+
+    /* In ack mode, the number of frames received and the number last
+     * acknowledged, along with the acknowledgement being written and how
+     * much of it has gone out.
+     */
+    uint64_t frames;
+    uint64_t acked;
+    unsigned char ack[ACK_SIZE];
+    size_t ack_sent;
+
+    /* A buffer of OUTPUT_BUFFER_SIZE bytes holding echoed frames, or data
+     * from server_send(), still to be written.
+     */
+    char *out;
+    size_t out_len;
+
+    /* Not being read from until the memory budget allows it a buffer. */
+    bool paused;
+
+    /* To be closed once its output is written (see server_close()). */
+    bool closing;
+
+    /* When the connection times out, on the server's clock. */
+    uint64_t deadline;
+
+    /* The connection's number, unique within the server, unlike its slot,
+     * which is reused once it closes.
+     */
+    uint64_t id;
+};
+
+/* A connection on its way from one server to another (see server_detach()),
+ * with the partial frame and any echo it had buffered, in that order.
+ */
+struct migration {
+    /* For queueing it between threads. */
+    struct queue_link link;
+
+    int handle;
+    uint64_t deadline;
+    uint64_t frames;
+    uint64_t acked;
+    unsigned char ack[ACK_SIZE];
+    size_t ack_sent;
+    bool closing;
+    size_t len;
+    size_t out_len;
+    char data[];
+};
+
+/* Buffers of one size, kept for reuse once released. */
+struct buffer_pool {
+    size_t size;
+
+    /* Released buffers, each holding a pointer to the next. */
+    void *free;
+
+    /* Buffers allocated, and of those, how many are held by connections. */
+    size_t allocated;
+    size_t in_use;
+};
+
+/* Time the event loop spent waiting, spinning or blocked, and how many waits
+ * found events while spinning.
+ */
+struct server_waits {
+    uint64_t spinning;
+    uint64_t blocked;
+    size_t spins;
+    size_t spin_hits;
+    size_t blocks;
+};
+
+/* The server's memory use in bytes. Only the buffers vary: everything else is
+ * allocated for every slot up front.
+ */
+struct server_memory {
+    /* The slot tables: pollfds, connections and the slot lists, including
+     * any rounding up to whole pages.
+     */
+    size_t tables;
+
+    /* The timer engine, not counting anything held by the kernel. */
+    size_t timers;
+
+    /* Receive and output buffers allocated, whether in use or pooled. */
+    size_t buffers;
+    size_t out_buffers;
+
+    size_t total;
+
+    /* Cost of each slot, whether in use or not, and of a connection's
+     * buffers while it is being read from.
+     */
+    size_t per_slot;
+    size_t per_reading_connection;
+
+    size_t connections;
+
+    /* Frame batches for the processing threads, outside the budget. */
+    size_t batches;
+};
+
+/* The clock and I/O the event loop runs on. Handles are file descriptors or
+ * whatever stands for them, and failing calls set errno as their system call
+ * counterparts would.
+ */
+struct server_backend {
+    void *ctx;
+
+    /* Monotonic time in nanoseconds. */
+    uint64_t (*now)(void *ctx);
+
+    /* Wait until there are events on any of the n slots in pfds, as poll()
+     * would, or until the clock reaches deadline (UINT64_MAX being never).
+     * The indices of the slots with events are stored in ready, and their
+     * number returned, or -1 on failure.
+     *
+     * pfds has one more entry after the n slots, which the backend may use
+     * for a handle of its own, such as a pipe to be woken up by. It is left
+     * with fd -1 otherwise, and never stored in ready.
+     */
+    int (*wait)(void *ctx, struct pollfd *pfds, size_t n, uint64_t deadline, size_t *ready);
+
+    /* Accept a connection on the listening handle, to be held in slot i
+     * (SIZE_MAX if there is no free slot), returning its handle.
+     */
+    int (*accept)(void *ctx, int listener, size_t i);
+
+    /* Nonblocking reads and writes. */
+    ssize_t (*recv)(void *ctx, int handle, void *buf, size_t n);
+    ssize_t (*send)(void *ctx, int handle, const void *buf, size_t n);
+
+    void (*close)(void *ctx, int handle);
+};
+
+struct server;
+
+/* What is done with the server's connections. Every callback is given the
+ * handler's ctx, the server and the connection's slot, and may be NULL to do
+ * nothing. On the loop's thread, the slot identifies the connection from
+ * on_connect until on_close.
+ *
+ * Callbacks are made from the loop's thread, and must not call into the
+ * server other than through server_send() and server_close(). With
+ * processing threads (see server_options), on_frame is made from one of
+ * them instead, after the loop has moved on: by then the slot may hold
+ * another connection, told apart by its id, and the callback must not call
+ * into the server at all.
+ */
+struct server_handler {
+    void *ctx;
+
+    /* A connection was accepted, or migrated in (see server_attach()). */
+    void (*on_connect)(void *ctx, struct server *server, size_t i);
+
+    /* A frame of n bytes arrived, without its newline. Empty frames are
+     * heartbeats, and not handed on. The frame is null-terminated, and lies
+     * in the connection's receive buffer, or a batch with processing
+     * threads, so it is only valid until the callback returns. id is the
+     * connection's id when the frame arrived, by which a processing thread
+     * can tell a frame from a connection since closed.
+     */
+    void (*on_frame)(void *ctx, struct server *server, size_t i, uint64_t id, const char *frame, size_t n);
+
+    /* The connection timed out, and is about to be closed. */
+    void (*on_timeout)(void *ctx, struct server *server, size_t i);
+
+    /* The connection is being closed or migrated out, for whatever reason,
+     * and its slot freed.
+     */
+    void (*on_close)(void *ctx, struct server *server, size_t i);
+};
+
+struct server {
+    const struct server_options *opts;
+    const struct server_backend *backend;
+    const struct server_handler *handler;
+    struct timer_engine *timers;
+
+    /* Set to stop the event loop. */
+    volatile sig_atomic_t *interrupted;
+
+    /* Where connections, disconnections and timeouts are logged, or NULL
+     * for nowhere, and the name to prefix each line with, or NULL for none.
+     */
+    FILE *log;
+    const char *name;
+
+    /* If set, a flag to report memory use when next checked, or NULL. */
+    volatile sig_atomic_t *report;
+
+    /* Client timeout in nanoseconds. */
+    uint64_t timeout;
+
+    /* Most nanoseconds to spin before blocking, the average gap between
+     * events and when the last came, by which the loop chooses whether to
+     * spin or block (see wait_for_events()), and where its waits went.
+     */
+    uint64_t max_spin;
+    uint64_t gap;
+    uint64_t last_event;
+    struct server_waits waits;
+
+    /* Connection slots, the first being the listening socket's. Sockets are
+     * held in the pollfd array (-1 denoting an unused slot).
+     */
+    size_t n;
+    struct pollfd *pfds;
+    struct connection *conns;
+
+    /* Stack of unused slots, and the slots with events from the last wait. */
+    size_t *free_slots;
+    size_t n_free;
+    size_t *ready;
+
+    /* Receive and output buffers. */
+    struct buffer_pool buffers;
+    struct buffer_pool out_buffers;
+
+    /* Bytes allocated for every slot up front, and the connections waiting
+     * for the memory budget to allow them a buffer.
+     */
+    size_t fixed_memory;
+    size_t *paused;
+    size_t n_paused;
+
+    /* Traffic capture file, if capturing, and the time the capture started. */
+    FILE *capture;
+    uint64_t capture_start;
+
+    /* Threads handing frames to the handler, if not handed on in the loop. */
+    struct pipeline *pipeline;
+
+    /* The id of the last connection accepted or migrated in. */
+    uint64_t last_id;
+};
+
+
+/* Initialise a server listening on the given handle, with the handler, or
+ * NULL for none. Returns 1 on failure.
+ */
+int server_init(struct server *server, const struct server_options *opts, const struct server_backend *backend, const struct server_handler *handler, struct timer_engine *timers, int listener, volatile sig_atomic_t *interrupted);
+int event_loop(struct server *server);
+void server_shutdown(struct server *server);
+void server_memory(const struct server *server, struct server_memory *memory);
+void server_report_memory(const struct server *server, FILE *out);
+void server_report_waits(const struct server *server, FILE *out);
+
+/* Queue n bytes to be written to connection i, once the loop is done with
+ * its events. Returns 1, queueing nothing, if the connection's output buffer
+ * has no room for them or there is no memory for one, or in ack mode, whose
+ * acknowledgements they would be interleaved with. From on_connect and
+ * on_frame on the loop's thread only.
+ */
+int server_send(struct server *server, size_t i, const char *data, size_t n);
+
+/* Close connection i once what has been queued for it is written, reading
+ * nothing more from it: frames already read but not yet handed on are
+ * dropped. From on_connect and on_frame on the loop's thread only.
+ */
+void server_close(struct server *server, size_t i);
+
+/* Take connection i out of the server, to be attached to another, returning
+ * NULL and leaving it in place if there is no memory for it.
+ */
+struct migration *server_detach(struct server *server, size_t i);
+
+/* Attach a connection detached from another server, taking the migration.
+ * Returns 1, having closed the connection, if there is no slot or memory for
+ * it. Between waits only, as from the backend's wait().
+ */
+int server_attach(struct server *server, struct migration *migration);
+
+#endif
@@ -0,0 +1,596 @@
+#ifndef TIMEOUT_SERVER_HPP
+#define TIMEOUT_SERVER_HPP
+
+#include <concepts>
+#include <coroutine>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <exception>
+#include <functional>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+/* The C headers use a flexible array member, which C++ only has as an
+ * extension.
+ */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+extern "C" {
+#include "sockets.h"
+#include "timeout_server.h"
+#include "timer.h"
+}
+
+#pragma GCC diagnostic pop
+
+
+/* A C++20 layer over the server library, in this header alone. A server is a
+ * template on its handler and three policies: the backend it runs on, its
+ * timeout engine, and its framing. The handler's callbacks are called
+ * directly from the trampolines given to the core, and so inlined there, and
+ * the policies are chosen at compile time, so that nothing is dispatched
+ * that the C core does not dispatch itself.
+ *
+ * Link with the library's C sources (see README.md).
+ */
+
+namespace timeout {
+
+/* Backends. A backend gives the core its struct server_backend, and opens the
+ * listening handle, returning -1 on failure.
+ */
+
+/* Real sockets, waited on with poll(). */
+struct sockets {
+    const server_backend *backend() const {
+        return &SOCKET_BACKEND;
+    }
+
+    int listen(const server_options &opts) const {
+        int listener;
+
+        return initialise_listening_socket(&listener, &opts, -1) ? -1 : listener;
+    }
+};
+
+
+/* Timeout engines. An engine policy names its kind, and creates the engine
+ * for the options, returning NULL on failure.
+ */
+
+/* Deadlines in a heap, checked against the backend's clock. */
+struct heap_timers {
+    static constexpr server_timers kind = SERVER_TIMERS_HEAP;
+
+    static timer_engine *create(const server_options &opts) {
+        return create_heap_engine(opts.max_connections, opts.table_flags);
+    }
+};
+
+/* A POSIX timer for each slot, raising Signal, whose handler this installs.
+ * Servers using the same signal share the handler and its flag.
+ */
+template <int Signal = SIGUSR1>
+struct posix_timers {
+    static constexpr server_timers kind = SERVER_TIMERS_POSIX;
+
+    static inline volatile std::sig_atomic_t triggered = 0;
+
+    static void on_signal(int) {
+        triggered = 1;
+    }
+
+    static timer_engine *create(const server_options &opts) {
+        struct sigaction action = {};
+
+        action.sa_handler = on_signal;
+        sigemptyset(&action.sa_mask);
+
+        if (sigaction(Signal, &action, nullptr)) {
+            std::perror("Failed to set the timer signal's handler");
+            return nullptr;
+        }
+
+        return create_posix_engine(opts.max_connections, Signal, &triggered, opts.table_flags);
+    }
+};
+
+
+/* Framing. The core splits frames on newlines, and may acknowledge or echo
+ * them itself, which a framing policy chooses.
+ */
+
+/* Frames handed to the handler. */
+struct lines {
+    static constexpr bool ack = false;
+    static constexpr bool echo = false;
+};
+
+/* Frames handed to the handler, and acknowledged (see send_ack()). The
+ * handler cannot send.
+ */
+struct acked_lines {
+    static constexpr bool ack = true;
+    static constexpr bool echo = false;
+};
+
+/* Frames echoed back to their sender, and not handed to the handler. */
+struct echoed_lines {
+    static constexpr bool ack = false;
+    static constexpr bool echo = true;
+};
+
+
+/* A connection, as seen by a handler's callbacks. Its slot identifies it from
+ * its connect until its close, on the loop's thread, and its id for as long as
+ * the server runs.
+ */
+class connection {
+public:
+    connection(::server *server, std::size_t slot, std::uint64_t id) : server_(server), slot_(slot), id_(id) {}
+
+    std::size_t slot() const {
+        return slot_;
+    }
+
+    std::uint64_t id() const {
+        return id_;
+    }
+
+    /* How many slots the server it is on has. */
+    std::size_t slots() const {
+        return server_->n;
+    }
+
+    /* The name of the server it is on, or NULL. */
+    const char *server_name() const {
+        return server_->name;
+    }
+
+    /* Queue data to be written to it, returning false if there is no room
+     * (see server_send()). From on_connect and on_frame on the loop's thread
+     * only.
+     */
+    bool send(std::string_view data) const {
+        return !server_send(server_, slot_, data.data(), data.size());
+    }
+
+    /* Close it once what has been sent is written (see server_close()). */
+    void close() const {
+        server_close(server_, slot_);
+    }
+
+private:
+    ::server *server_;
+    std::size_t slot_;
+    std::uint64_t id_;
+};
+
+
+/* A handler is either callable with a connection and a frame, for a handler
+ * of frames alone, or has any of these members. Callbacks must not throw:
+ * an exception terminates the program rather than unwind through the core.
+ */
+template <class H>
+concept frame_function = std::invocable<H &, connection, std::string_view>;
+
+template <class H>
+concept handles_connect = requires(H &h, connection c) { h.on_connect(c); };
+
+template <class H>
+concept handles_frame = requires(H &h, connection c, std::string_view frame) { h.on_frame(c, frame); };
+
+template <class H>
+concept handles_timeout = requires(H &h, connection c) { h.on_timeout(c); };
+
+template <class H>
+concept handles_close = requires(H &h, connection c) { h.on_close(c); };
+
+/* A handler that must be called on the loop's thread, and so cannot have
+ * its frames handed on by processing threads.
+ */
+template <class H>
+concept loop_only = H::loop_only;
+
+
+/* A server running the handler, listening as its options say. The options'
+ * ack, echo and timers are set by the policies. Construction throws
+ * std::runtime_error on failure, the reason having been printed.
+ */
+template <class Handler, class Backend = sockets, class Timers = heap_timers, class Framing = lines>
+class server {
+public:
+    server(Handler handler, const server_options &opts, Backend backend = Backend())
+        : handler_(std::move(handler)), backend_(std::move(backend)), opts_(opts) {
+        int listener;
+
+        opts_.ack = Framing::ack;
+        opts_.echo = Framing::echo;
+        opts_.timers = Timers::kind;
+
+        if (loop_only<Handler> && opts_.processors > 0U)
+            throw std::runtime_error("Handler cannot be used with processing threads");
+
+        callbacks_ = ::server_handler {
+            .ctx = this,
+            .on_connect = handles_connect<Handler> ? on_connect : nullptr,
+            .on_frame = frame_function<Handler> || handles_frame<Handler> ? on_frame : nullptr,
+            .on_timeout = handles_timeout<Handler> ? on_timeout : nullptr,
+            .on_close = handles_close<Handler> ? on_close : nullptr
+        };
+
+        timers_ = Timers::create(opts_);
+
+        if (!timers_)
+            throw std::runtime_error("Failed to create timeout timers");
+
+        listener = backend_.listen(opts_);
+
+        if (listener < 0) {
+            timers_->destroy(timers_);
+            throw std::runtime_error("Failed to initialise listening socket");
+        }
+
+        if (server_init(&server_, &opts_, backend_.backend(), &callbacks_, timers_, listener, &interrupted_)) {
+            backend_.backend()->close(backend_.backend()->ctx, listener);
+            timers_->destroy(timers_);
+            throw std::runtime_error("Failed to initialise server");
+        }
+    }
+
+    /* The core holds pointers into the object. */
+    server(const server &) = delete;
+    server &operator=(const server &) = delete;
+
+    ~server() {
+        server_shutdown(&server_);
+        timers_->destroy(timers_);
+    }
+
+    /* Run the event loop until stopped. Returns 0, or 1 on failure. */
+    int run() {
+        return event_loop(&server_);
+    }
+
+    /* Stop the event loop at its next check, as from a signal handler. */
+    void stop() {
+        interrupted_ = 1;
+    }
+
+    /* Where connections, disconnections and timeouts are logged, stderr
+     * by default, or NULL for nowhere, and the name to prefix each line
+     * with.
+     */
+    void log_to(std::FILE *log, const char *name = nullptr) {
+        server_.log = log;
+        server_.name = name;
+    }
+
+    void report(std::FILE *out) const {
+        server_report_memory(&server_, out);
+        server_report_waits(&server_, out);
+    }
+
+    Handler &handler() {
+        return handler_;
+    }
+
+    ::server &core() {
+        return server_;
+    }
+
+private:
+    static Handler &handler_of(void *ctx) {
+        return static_cast<server *>(ctx)->handler_;
+    }
+
+    static void on_connect(void *ctx, ::server *s, std::size_t i) noexcept {
+        if constexpr (handles_connect<Handler>)
+            handler_of(ctx).on_connect(connection(s, i, s->conns[i].id));
+    }
+
+    static void on_frame(void *ctx, ::server *s, std::size_t i, std::uint64_t id, const char *frame, std::size_t n) noexcept {
+        if constexpr (frame_function<Handler>)
+            handler_of(ctx)(connection(s, i, id), std::string_view(frame, n));
+        else if constexpr (handles_frame<Handler>)
+            handler_of(ctx).on_frame(connection(s, i, id), std::string_view(frame, n));
+    }
+
+    static void on_timeout(void *ctx, ::server *s, std::size_t i) noexcept {
+        if constexpr (handles_timeout<Handler>)
+            handler_of(ctx).on_timeout(connection(s, i, s->conns[i].id));
+    }
+
+    static void on_close(void *ctx, ::server *s, std::size_t i) noexcept {
+        if constexpr (handles_close<Handler>)
+            handler_of(ctx).on_close(connection(s, i, s->conns[i].id));
+    }
+
+    Handler handler_;
+    Backend backend_;
+    server_options opts_;
+    ::server_handler callbacks_;
+    timer_engine *timers_ = nullptr;
+    volatile std::sig_atomic_t interrupted_ = 0;
+    ::server server_;
+};
+
+
+/* Coroutines. Rather than be called back, a connection's handler can be a
+ * coroutine, run from its connect and resumed with each of its frames:
+ *
+ *     timeout::task session(timeout::stream s) {
+ *         while (auto frame = co_await s.next())
+ *             s.send(*frame);
+ *     }
+ *
+ *     timeout::server srv{timeout::coroutines(session), opts};
+ *
+ * The connection is closed when the coroutine returns, and the coroutine
+ * destroyed, wherever it is suspended, when the connection closes. Bind what
+ * next() gives, as above: GCC 12 miscompiles a co_await that is itself a
+ * loop's condition.
+ */
+
+/* Coroutine frames of up to MAX_SIZE bytes, kept for reuse once freed, in
+ * lists by size, so that once warmed up, starting a connection's coroutine
+ * allocates nothing. Each thread has its own, as connections' coroutines
+ * only ever run on their loop's thread.
+ */
+class frame_pool {
+public:
+    static constexpr std::size_t GRANULE = 64U;
+    static constexpr std::size_t MAX_SIZE = 4096U;
+
+    /* Returns NULL if there is no memory. */
+    static void *allocate(std::size_t n) noexcept {
+        const std::size_t k = (n + GRANULE - 1U) / GRANULE;
+
+        if (k * GRANULE > MAX_SIZE)
+            return ::operator new(n, std::nothrow);
+
+        if (block *b = pool().free[k]) {
+            pool().free[k] = b->next;
+            return b;
+        }
+
+        return ::operator new(k * GRANULE, std::nothrow);
+    }
+
+    static void release(void *p, std::size_t n) noexcept {
+        const std::size_t k = (n + GRANULE - 1U) / GRANULE;
+
+        if (k * GRANULE > MAX_SIZE) {
+            ::operator delete(p);
+            return;
+        }
+
+        pool().free[k] = new (p) block {pool().free[k]};
+    }
+
+    frame_pool() = default;
+    frame_pool(const frame_pool &) = delete;
+    frame_pool &operator=(const frame_pool &) = delete;
+
+    ~frame_pool() {
+        for (block *b : free) {
+            while (b) {
+                block *next = b->next;
+
+                ::operator delete(b);
+                b = next;
+            }
+        }
+    }
+
+private:
+    struct block {
+        block *next;
+    };
+
+    static frame_pool &pool() {
+        thread_local frame_pool pool;
+
+        return pool;
+    }
+
+    block *free[MAX_SIZE / GRANULE + 1U] = {};
+};
+
+
+/* A connection's coroutine. It runs from its start until it first waits, and
+ * is left suspended at its end, for its connection to destroy it. Without
+ * the memory for it, it is never started, and its connection is closed.
+ */
+class task {
+public:
+    struct promise_type {
+        task get_return_object() {
+            return task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        static task get_return_object_on_allocation_failure() {
+            return task(nullptr);
+        }
+
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_always final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {}
+
+        /* As with callbacks, nothing may unwind through the core. */
+        void unhandled_exception() {
+            std::terminate();
+        }
+
+        static void *operator new(std::size_t n) noexcept {
+            return frame_pool::allocate(n);
+        }
+
+        static void operator delete(void *p, std::size_t n) noexcept {
+            frame_pool::release(p, n);
+        }
+    };
+
+    explicit task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+    std::coroutine_handle<promise_type> release() {
+        return std::exchange(handle_, nullptr);
+    }
+
+    task(const task &) = delete;
+    task &operator=(const task &) = delete;
+
+    task(task &&other) noexcept : handle_(other.release()) {}
+
+    ~task() {
+        if (handle_)
+            handle_.destroy();
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+
+/* What a connection's coroutine has of it: the next frame, replies, and its
+ * close.
+ */
+class stream {
+public:
+    /* A connection's coroutine, and what it was last resumed with. */
+    struct state {
+        std::coroutine_handle<task::promise_type> handle;
+        std::optional<std::string_view> event;
+        bool closing = false;
+    };
+
+    struct frame_awaiter {
+        state *waiting;
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        void await_suspend(std::coroutine_handle<>) const noexcept {}
+
+        std::optional<std::string_view> await_resume() const noexcept {
+            return waiting->event;
+        }
+    };
+
+    stream(connection conn, state *waiting) : conn_(conn), waiting_(waiting) {}
+
+    /* Wait for the next frame, or for the connection to time out, which
+     * gives std::nullopt, after which it is closed. The frame is in place in
+     * the receive buffer, so only valid until the coroutine next waits.
+     */
+    frame_awaiter next() const {
+        return frame_awaiter {waiting_};
+    }
+
+    std::size_t slot() const {
+        return conn_.slot();
+    }
+
+    /* As connection::send(), though not once the connection has timed
+     * out.
+     */
+    bool send(std::string_view data) const {
+        return conn_.send(data);
+    }
+
+private:
+    connection conn_;
+    state *waiting_;
+};
+
+
+/* The handler running Coroutine, a function from a stream to a task, for
+ * each connection. Every slot's state is allocated on the first connect.
+ */
+template <class Coroutine>
+class coroutines {
+public:
+    static constexpr bool loop_only = true;
+
+    explicit coroutines(Coroutine coroutine) : coroutine_(std::move(coroutine)) {}
+
+    void on_connect(connection c) {
+        stream::state &state = states_for(c)[c.slot()];
+
+        state = stream::state {};
+        state.handle = std::invoke(coroutine_, stream(c, &state)).release();
+        finish(c, state);
+    }
+
+    void on_frame(connection c, std::string_view frame) {
+        resume(c, frame);
+    }
+
+    void on_timeout(connection c) {
+        resume(c, std::nullopt);
+    }
+
+    void on_close(connection c) {
+        stream::state &state = states_[c.slot()];
+
+        if (state.handle)
+            state.handle.destroy();
+
+        state.handle = nullptr;
+    }
+
+private:
+    std::vector<stream::state> &states_for(connection c) {
+        if (states_.empty())
+            states_.resize(c.slots());
+
+        return states_;
+    }
+
+    void resume(connection c, std::optional<std::string_view> event) {
+        stream::state &state = states_[c.slot()];
+
+        if (!state.handle || state.handle.done())
+            return;
+
+        state.event = event;
+        state.handle.resume();
+
+        /* A connection that timed out is closed by the core, and may not be
+         * closed from on_timeout.
+         */
+        if (event)
+            finish(c, state);
+    }
+
+    /* A coroutine that has returned, or never started, is done with its
+     * connection.
+     */
+    void finish(connection c, stream::state &state) {
+        if ((!state.handle || state.handle.done()) && !state.closing) {
+            state.closing = true;
+            c.close();
+        }
+    }
+
+    Coroutine coroutine_;
+    std::vector<stream::state> states_;
+};
+
+}
+
+#endif
@@ -0,0 +1,398 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "table.h"
+#include "timer.h"
+
+
+static const uint64_t NSEC_PER_SEC = 1000000000U;
+
+
+/* Engine over one POSIX timer per slot. */
+struct posix_engine {
+    struct timer_engine engine;
+
+    timer_t *timers;
+    bool *armed;
+    size_t n;
+    volatile sig_atomic_t *triggered;
+
+    /* Next slot to check for expiry, or n when not checking. */
+    size_t cursor;
+};
+
+/* Engine over a binary min-heap of deadlines. */
+struct heap_entry {
+    uint64_t deadline;
+    size_t slot;
+};
+
+struct heap_engine {
+    struct timer_engine engine;
+
+    struct heap_entry *heap;
+    size_t size;
+
+    /* Index of each slot's entry in the heap, or SIZE_MAX when disarmed. */
+    size_t *positions;
+};
+
+
+static int posix_arm(struct timer_engine *engine, size_t i, uint64_t now, uint64_t timeout);
+static int posix_disarm(struct timer_engine *engine, size_t i);
+static bool posix_next_expired(struct timer_engine *engine, uint64_t now, size_t *i);
+static uint64_t posix_next_deadline(const struct timer_engine *engine);
+static void posix_destroy(struct timer_engine *engine);
+
+static void heap_swap(struct heap_engine *h, size_t a, size_t b);
+static void heap_sift_up(struct heap_engine *h, size_t k);
+static void heap_sift_down(struct heap_engine *h, size_t k);
+static void heap_remove(struct heap_engine *h, size_t k);
+static int heap_arm(struct timer_engine *engine, size_t i, uint64_t now, uint64_t timeout);
+static int heap_disarm(struct timer_engine *engine, size_t i);
+static bool heap_next_expired(struct timer_engine *engine, uint64_t now, size_t *i);
+static uint64_t heap_next_deadline(const struct timer_engine *engine);
+static void heap_destroy(struct timer_engine *engine);
+
+
+int create_timers(timer_t *timers, size_t n, int signal) {
+    for (size_t i = 0U; i < n; ++i) {
+        struct sigevent event = {
+            .sigev_notify = SIGEV_SIGNAL,
+            .sigev_signo = signal,
+            .sigev_value.sival_ptr = timers[i]
+        };
+
+        if (timer_create(CLOCK_REALTIME, &event, &timers[i])) {
+            perror("Failed to create timer");
+            destroy_timers(timers, i);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+int destroy_timers(timer_t *timers, size_t n) {
+    for (size_t i = 0U; i < n; ++i) {
+        if (timer_delete(timers[i])) {
+            perror("Failed to destroy timer");
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+
+int arm_timer(timer_t timer, const struct timespec *timeout) {
+    struct itimerspec its = {
+        .it_value = *timeout
+    };
+
+    if (timer_settime(timer, 0, &its, NULL)) {
+        perror("Failed to arm timer");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+int disarm_timer(timer_t timer) {
+    struct itimerspec its = {0};
+
+    if (timer_settime(timer, 0, &its, NULL)) {
+        perror("Failed to disarm timer");
+        return 1;
+    }
+
+    return 0;
+}
+
+
+bool timer_expired(timer_t timer) {
+    struct itimerspec its;
+
+    if (timer_gettime(timer, &its)) {
+        perror("Failed to get state of timer");
+        exit(EXIT_FAILURE);
+    }
+
+    if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+        return true;
+
+    return false;
+}
+
+
+static int posix_arm(struct timer_engine *engine, size_t i, uint64_t now, uint64_t timeout) {
+    struct posix_engine *posix = (struct posix_engine *) engine;
+
+    struct timespec ts = {
+        .tv_sec = (time_t) (timeout / NSEC_PER_SEC),
+        .tv_nsec = (long) (timeout % NSEC_PER_SEC)
+    };
+
+    /* The kernel keeps its own time. */
+    (void) now;
+
+    if (arm_timer(posix->timers[i], &ts))
+        return 1;
+
+    posix->armed[i] = true;
+    return 0;
+}
+
+
+static int posix_disarm(struct timer_engine *engine, size_t i) {
+    struct posix_engine *posix = (struct posix_engine *) engine;
+
+    posix->armed[i] = false;
+    return disarm_timer(posix->timers[i]);
+}
+
+
+static bool posix_next_expired(struct timer_engine *engine, uint64_t now, size_t *i) {
+    struct posix_engine *posix = (struct posix_engine *) engine;
+
+    (void) now;
+
+    if (posix->cursor == posix->n) {
+        if (!*posix->triggered)
+            return false;
+
+        /* Reset flag at start of check so any timer can go off during the
+         * check and just wait till after to get attended to.
+         */
+        *posix->triggered = 0;
+        posix->cursor = 0U;
+    }
+
+    /* It is impossible to reliably count signals, so we must check every
+     * single connection for a timeout.
+     */
+    while (posix->cursor < posix->n) {
+        size_t j = posix->cursor++;
+
+        if (posix->armed[j] && timer_expired(posix->timers[j])) {
+            posix->armed[j] = false;
+            *i = j;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+static uint64_t posix_next_deadline(const struct timer_engine *engine) {
+    (void) engine;
+    return UINT64_MAX;
+}
+
+
+static void posix_destroy(struct timer_engine *engine) {
+    struct posix_engine *posix = (struct posix_engine *) engine;
+
+    destroy_timers(posix->timers, posix->n);
+    table_free(posix->timers);
+    table_free(posix->armed);
+    free(posix);
+}
+
+
+struct timer_engine *create_posix_engine(size_t n, int signal, volatile sig_atomic_t *triggered, unsigned table_flags) {
+    struct posix_engine *posix = calloc(1U, sizeof(*posix));
+
+    if (!posix) {
+        perror("Failed to allocate timers");
+        return NULL;
+    }
+
+    posix->engine = (struct timer_engine) {
+        .arm = posix_arm,
+        .disarm = posix_disarm,
+        .next_expired = posix_next_expired,
+        .next_deadline = posix_next_deadline,
+        .destroy = posix_destroy
+    };
+
+    posix->timers = table_alloc(n * sizeof(*posix->timers), table_flags, "timer table");
+    posix->armed = table_alloc(n * sizeof(*posix->armed), table_flags, "timer state table");
+    posix->n = n;
+    posix->triggered = triggered;
+    posix->cursor = n;
+
+    if (!posix->timers || !posix->armed) {
+        table_free(posix->timers);
+        table_free(posix->armed);
+        free(posix);
+        return NULL;
+    }
+
+    if (create_timers(posix->timers, n, signal)) {
+        table_free(posix->timers);
+        table_free(posix->armed);
+        free(posix);
+        return NULL;
+    }
+
+    posix->engine.memory = table_size(posix->timers) + table_size(posix->armed);
+
+    return &posix->engine;
+}
+
+
+static void heap_swap(struct heap_engine *h, size_t a, size_t b) {
+    struct heap_entry entry = h->heap[a];
+
+    h->heap[a] = h->heap[b];
+    h->heap[b] = entry;
+    h->positions[h->heap[a].slot] = a;
+    h->positions[h->heap[b].slot] = b;
+}
+
+
+static void heap_sift_up(struct heap_engine *h, size_t k) {
+    while (k > 0U) {
+        size_t parent = (k - 1U) / 2U;
+
+        if (h->heap[parent].deadline <= h->heap[k].deadline)
+            break;
+
+        heap_swap(h, parent, k);
+        k = parent;
+    }
+}
+
+
+static void heap_sift_down(struct heap_engine *h, size_t k) {
+    while (1) {
+        size_t child = 2U * k + 1U;
+
+        if (child >= h->size)
+            break;
+
+        if (child + 1U < h->size && h->heap[child + 1U].deadline < h->heap[child].deadline)
+            ++child;
+
+        if (h->heap[k].deadline <= h->heap[child].deadline)
+            break;
+
+        heap_swap(h, k, child);
+        k = child;
+    }
+}
+
+
+static void heap_remove(struct heap_engine *h, size_t k) {
+    size_t last = --h->size;
+    size_t slot;
+
+    h->positions[h->heap[k].slot] = SIZE_MAX;
+
+    if (k == last)
+        return;
+
+    h->heap[k] = h->heap[last];
+    slot = h->heap[k].slot;
+    h->positions[slot] = k;
+    heap_sift_up(h, k);
+    heap_sift_down(h, h->positions[slot]);
+}
+
+
+static int heap_arm(struct timer_engine *engine, size_t i, uint64_t now, uint64_t timeout) {
+    struct heap_engine *h = (struct heap_engine *) engine;
+
+    size_t k = h->positions[i];
+
+    if (k == SIZE_MAX) {
+        k = h->size++;
+        h->heap[k].slot = i;
+        h->positions[i] = k;
+    }
+
+    h->heap[k].deadline = now + timeout;
+
+    /* Rearming almost always pushes the deadline back, so the entry
+     * usually only moves down.
+     */
+    heap_sift_up(h, k);
+    heap_sift_down(h, h->positions[i]);
+    return 0;
+}
+
+
+static int heap_disarm(struct timer_engine *engine, size_t i) {
+    struct heap_engine *h = (struct heap_engine *) engine;
+
+    if (h->positions[i] != SIZE_MAX)
+        heap_remove(h, h->positions[i]);
+
+    return 0;
+}
+
+
+static bool heap_next_expired(struct timer_engine *engine, uint64_t now, size_t *i) {
+    struct heap_engine *h = (struct heap_engine *) engine;
+
+    if (h->size == 0U || h->heap[0].deadline > now)
+        return false;
+
+    *i = h->heap[0].slot;
+    heap_remove(h, 0U);
+    return true;
+}
+
+
+static uint64_t heap_next_deadline(const struct timer_engine *engine) {
+    const struct heap_engine *h = (const struct heap_engine *) engine;
+
+    return h->size > 0U ? h->heap[0].deadline : UINT64_MAX;
+}
+
+
+static void heap_destroy(struct timer_engine *engine) {
+    struct heap_engine *h = (struct heap_engine *) engine;
+
+    table_free(h->heap);
+    table_free(h->positions);
+    free(h);
+}
+
+
+struct timer_engine *create_heap_engine(size_t n, unsigned table_flags) {
+    struct heap_engine *h = calloc(1U, sizeof(*h));
+
+    if (!h) {
+        perror("Failed to allocate timers");
+        return NULL;
+    }
+
+    h->engine = (struct timer_engine) {
+        .arm = heap_arm,
+        .disarm = heap_disarm,
+        .next_expired = heap_next_expired,
+        .next_deadline = heap_next_deadline,
+        .destroy = heap_destroy
+    };
+
+    h->heap = table_alloc(n * sizeof(*h->heap), table_flags, "deadline heap");
+    h->positions = table_alloc(n * sizeof(*h->positions), table_flags, "deadline position table");
+
+    if (!h->heap || !h->positions) {
+        heap_destroy(&h->engine);
+        return NULL;
+    }
+
+    for (size_t i = 0U; i < n; ++i)
+        h->positions[i] = SIZE_MAX;
+
+    h->engine.memory = table_size(h->heap) + table_size(h->positions);
+
+    return &h->engine;
+}
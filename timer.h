@@ -0,0 +1,62 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+
+/* Client timeout timers: one POSIX per-process timer for each connection
+ * slot, raising a signal when it expires.
+ */
+
+int create_timers(timer_t *timers, size_t n, int signal);
+int destroy_timers(timer_t *timers, size_t n);
+int arm_timer(timer_t timer, const struct timespec *timeout);
+int disarm_timer(timer_t timer);
+bool timer_expired(timer_t timer);
+
+
+/* A timeout engine, holding a timer for each of a server's connection slots.
+ * Times are in nanoseconds on the server's clock.
+ */
+struct timer_engine {
+    /* Bytes allocated for the slots' timers, not counting anything held by
+     * the kernel.
+     */
+    size_t memory;
+
+    /* Arm slot i's timer to expire timeout after now, replacing any earlier
+     * deadline, or disarm it.
+     */
+    int (*arm)(struct timer_engine *engine, size_t i, uint64_t now, uint64_t timeout);
+    int (*disarm)(struct timer_engine *engine, size_t i);
+
+    /* Find a slot whose timer has expired by now and disarm it. Returns false
+     * once there are none left.
+     */
+    bool (*next_expired)(struct timer_engine *engine, uint64_t now, size_t *i);
+
+    /* Time at which the next timer expires, or UINT64_MAX if none is armed
+     * or the engine cannot tell (it raises a signal instead).
+     */
+    uint64_t (*next_deadline)(const struct timer_engine *engine);
+
+    void (*destroy)(struct timer_engine *engine);
+};
+
+/* The POSIX timers above, which expire in real time whatever the server's
+ * clock. Their signal's handler must set *triggered, which tells the engine
+ * to look for expired timers. The engines' arrays are allocated with
+ * table_alloc() and table_flags (see table.h).
+ */
+struct timer_engine *create_posix_engine(size_t n, int signal, volatile sig_atomic_t *triggered, unsigned table_flags);
+
+/* Deadlines kept in a binary heap in userspace. They only expire when
+ * checked against the server's clock, so work with a simulated one too.
+ */
+struct timer_engine *create_heap_engine(size_t n, unsigned table_flags);
+
+#endif
@@ -0,0 +1,687 @@
+/* For CPU affinity. */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include "ring.h"
+#include "sockets.h"
+#include "timer.h"
+#include "workers.h"
+
+
+/* Difference in connections between the busiest and least busy workers left
+ * alone when balancing, as a fraction of the busiest's (1/8) on top of one.
+ */
+static const size_t BALANCE_SLACK = 8U;
+
+
+/* An event loop thread in multi-worker mode, with its own listening socket,
+ * timer engine and connection slots.
+ */
+struct worker {
+    size_t id;
+    int cpu;
+    char name[32];
+    const struct server_options *opts;
+    const struct server_handler *handler;
+    struct server_backend backend;
+
+    /* The worker's listening socket, or with an acceptor, the read end of
+     * its handoff wakeup.
+     */
+    int listener;
+
+    /* For other threads to wake the worker from its wait (see
+     * open_wakeup()).
+     */
+    int wake[2];
+
+    /* Set by the controlling thread before waking the worker. */
+    volatile sig_atomic_t interrupted;
+    volatile sig_atomic_t report;
+
+    /* With an acceptor, the connections it has handed the worker, the
+     * wakeup it sends with them, and whether one is due.
+     */
+    struct ring handoff;
+    int handoff_wake[2];
+    bool handoff_pending;
+
+    /* Connections the worker has accepted, been migrated and closed or
+     * migrated away, kept by the worker for others to tell its load.
+     */
+    size_t accepted;
+    size_t migrated_in;
+    size_t closed;
+
+    /* Connections migrated to the worker, and a request from the balancer
+     * to migrate some of its own to another (see balance_workers()).
+     */
+    struct queue inbox;
+    struct worker *migrate_to;
+    size_t migrate_count;
+
+    struct server *server;
+    pthread_t thread;
+    int status;
+};
+
+/* The thread accepting every connection when the workers do not. */
+struct acceptor {
+    int listener;
+    int wake[2];
+    volatile sig_atomic_t interrupted;
+
+    /* The workers, how many connections each has been handed, and which to
+     * look at first for the next.
+     */
+    struct worker *workers;
+    size_t n;
+    size_t *assigned;
+    size_t next;
+
+    pthread_t thread;
+    int status;
+};
+
+struct workers {
+    const struct server_options *opts;
+
+    struct worker *workers;
+    size_t n;
+
+    struct acceptor acceptor;
+    bool accepting;
+};
+
+
+static int worker_wait(void *ctx, struct pollfd *pfds, size_t n, uint64_t deadline, size_t *ready);
+static int worker_accept(void *ctx, int listener, size_t i);
+static void worker_close(void *ctx, int handle);
+
+static size_t worker_load(const struct worker *worker);
+static void migrate_connections(struct worker *worker);
+static void receive_connections(struct worker *worker);
+static void balance_workers(struct worker *workers, size_t n);
+static void pin_worker(const struct worker *worker);
+static void *run_worker(void *arg);
+static int start_worker(struct worker *worker, size_t id, const struct server_options *opts, const struct server_handler *handler);
+static void release_worker(struct worker *worker);
+static void hand_off_connections(struct acceptor *acceptor);
+static void *run_acceptor(void *arg);
+static int start_acceptor(struct acceptor *acceptor, struct worker *workers, const struct server_options *opts);
+
+/* A worker's backend is the socket backend, with connections migrated in
+ * and out between its loop's waits, when it is safe to change its slots.
+ */
+static int worker_wait(void *ctx, struct pollfd *pfds, size_t n, uint64_t deadline, size_t *ready) {
+    struct worker *worker = ctx;
+    struct timer_engine *timers = worker->server->timers;
+
+    migrate_connections(worker);
+    receive_connections(worker);
+
+    /* A connection migrated in may be due before anything else. */
+    if (timers->next_deadline(timers) < deadline)
+        deadline = timers->next_deadline(timers);
+
+    return SOCKET_BACKEND.wait(ctx, pfds, n, deadline, ready);
+}
+
+
+/* With an acceptor, a worker takes connections from its handoff ring, and is
+ * woken for them through the wakeup standing in for its listening socket.
+ */
+static int worker_accept(void *ctx, int listener, size_t i) {
+    struct worker *worker = ctx;
+    void *entry;
+    int s;
+
+    if (!worker->opts->acceptor) {
+        s = SOCKET_BACKEND.accept(ctx, listener, i);
+    } else if (ring_pop(&worker->handoff, &entry)) {
+        s = (int) (intptr_t) entry;
+    } else {
+        /* Look again after draining the wakeup, as the acceptor may have
+         * pushed a connection since, and its wakeup been drained with the
+         * rest.
+         */
+        drain_wakeup(listener);
+
+        if (!ring_pop(&worker->handoff, &entry)) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        s = (int) (intptr_t) entry;
+    }
+
+    if (s >= 0)
+        __atomic_store_n(&worker->accepted, worker->accepted + 1U, __ATOMIC_RELAXED);
+
+    return s;
+}
+
+
+static void worker_close(void *ctx, int handle) {
+    struct worker *worker = ctx;
+
+    if (handle == worker->listener) {
+        /* The handoff wakeup is closed with the rest of the worker, once
+         * the acceptor has stopped.
+         */
+        if (!worker->opts->acceptor)
+            close(handle);
+
+        return;
+    }
+
+    close(handle);
+    __atomic_store_n(&worker->closed, worker->closed + 1U, __ATOMIC_RELAXED);
+}
+
+/* The counts are read apart from each other, while the worker moves them,
+ * so closed is read first, and the load held at 0 should it still come out
+ * ahead.
+ */
+static size_t worker_load(const struct worker *worker) {
+    size_t closed = __atomic_load_n(&worker->closed, __ATOMIC_RELAXED);
+    size_t total = __atomic_load_n(&worker->accepted, __ATOMIC_RELAXED) + __atomic_load_n(&worker->migrated_in, __ATOMIC_RELAXED);
+
+    return total > closed ? total - closed : 0U;
+}
+
+
+/* Carries out any request from the balancer, taking connections from the top
+ * slots down, and counting them as closed here.
+ */
+static void migrate_connections(struct worker *worker) {
+    struct server *server = worker->server;
+
+    size_t count = __atomic_exchange_n(&worker->migrate_count, 0U, __ATOMIC_ACQUIRE);
+    struct worker *to;
+    size_t moved = 0U;
+
+    if (count == 0U)
+        return;
+
+    to = __atomic_load_n(&worker->migrate_to, __ATOMIC_RELAXED);
+
+    for (size_t i = server->n - 1U; i > 0U && moved < count; --i) {
+        struct migration *migration;
+
+        if (server->pfds[i].fd < 0)
+            continue;
+
+        migration = server_detach(server, i);
+
+        if (!migration)
+            break;
+
+        queue_push(&to->inbox, &migration->link);
+        __atomic_store_n(&worker->closed, worker->closed + 1U, __ATOMIC_RELAXED);
+        ++moved;
+    }
+
+    if (moved > 0U)
+        send_wakeup(to->wake);
+}
+
+
+static void receive_connections(struct worker *worker) {
+    struct queue_link *link = queue_take(&worker->inbox);
+
+    while (link) {
+        struct queue_link *next = link->next;
+
+        /* The migration starts with its link. A connection that cannot be
+         * attached is closed, and so counted either way.
+         */
+        __atomic_store_n(&worker->migrated_in, worker->migrated_in + 1U, __ATOMIC_RELAXED);
+
+        if (server_attach(worker->server, (struct migration *) link))
+            __atomic_store_n(&worker->closed, worker->closed + 1U, __ATOMIC_RELAXED);
+
+        link = next;
+    }
+}
+
+
+/* Asks the busiest worker to migrate half the difference between it and the
+ * least busy to it, unless they are close enough or a request is still
+ * being carried out.
+ */
+static void balance_workers(struct worker *workers, size_t n) {
+    struct worker *busiest = &workers[0];
+    struct worker *idlest = &workers[0];
+    size_t most = 0U;
+    size_t least = SIZE_MAX;
+
+    for (size_t i = 0U; i < n; ++i) {
+        size_t load = worker_load(&workers[i]);
+
+        if (load > most) {
+            most = load;
+            busiest = &workers[i];
+        }
+
+        if (load < least) {
+            least = load;
+            idlest = &workers[i];
+        }
+    }
+
+    if (most - least <= 1U + most / BALANCE_SLACK || __atomic_load_n(&busiest->migrate_count, __ATOMIC_ACQUIRE) > 0U)
+        return;
+
+    fprintf(stderr, "Balancing: moving %zu connections from %s (%zu) to %s (%zu)\n", (most - least) / 2U, busiest->name, most, idlest->name, least);
+
+    __atomic_store_n(&busiest->migrate_to, idlest, __ATOMIC_RELAXED);
+    __atomic_store_n(&busiest->migrate_count, (most - least) / 2U, __ATOMIC_RELEASE);
+    send_wakeup(busiest->wake);
+}
+
+
+static void pin_worker(const struct worker *worker) {
+#ifdef __linux__
+    cpu_set_t set;
+    int err;
+
+    CPU_ZERO(&set);
+    CPU_SET(worker->cpu, &set);
+
+    err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    if (err) {
+        errno = err;
+        fprintf(stderr, "[%s] Failed to pin to CPU %d, running unpinned", worker->name, worker->cpu);
+        perror(NULL);
+    }
+#else
+    fprintf(stderr, "[%s] CPU affinity is not supported here, running unpinned\n", worker->name);
+#endif
+}
+
+
+static void *run_worker(void *arg) {
+    struct worker *worker = arg;
+    const struct server_options *opts = worker->opts;
+
+    struct timer_engine *timers;
+    struct server *server;
+
+    pin_worker(worker);
+
+    /* Everything the worker uses is allocated here, once pinned, so that it
+     * is first touched, and so placed, on its CPU's NUMA node.
+     */
+    timers = create_heap_engine(opts->max_connections, opts->table_flags);
+    server = malloc(sizeof(*server));
+
+    if (!timers || !server || server_init(server, opts, &worker->backend, worker->handler, timers, worker->listener, &worker->interrupted)) {
+        if (!server)
+            perror("Failed to allocate worker");
+
+        if (timers)
+            timers->destroy(timers);
+
+        free(server);
+        worker->status = 1;
+
+        /* Without an acceptor, the listening socket is the worker's. */
+        if (!opts->acceptor)
+            close(worker->listener);
+
+        /* Bring the whole server down. */
+        kill(getpid(), SIGINT);
+        return NULL;
+    }
+
+    worker->server = server;
+    server->name = worker->name;
+    server->report = &worker->report;
+    server->pfds[server->n].fd = worker->wake[0];
+    server->pfds[server->n].events = POLLIN;
+
+    fprintf(stderr, "[%s] Running on CPU %d\n", worker->name, worker->cpu);
+    worker->status = event_loop(server);
+
+    /* A worker only stops by itself on failure. */
+    if (!worker->interrupted)
+        kill(getpid(), SIGINT);
+
+    server_report_memory(server, stderr);
+    server_report_waits(server, stderr);
+
+    server_shutdown(server);
+    timers->destroy(timers);
+    free(server);
+    return NULL;
+}
+
+
+static int start_worker(struct worker *worker, size_t id, const struct server_options *opts, const struct server_handler *handler) {
+    int err;
+
+    *worker = (struct worker) {
+        .id = id,
+        .cpu = opts->cpus[id],
+        .opts = opts,
+        .handler = handler,
+        .backend = SOCKET_BACKEND,
+        .listener = -1,
+        .wake = {-1, -1},
+        .handoff_wake = {-1, -1}
+    };
+
+    worker->backend.ctx = worker;
+    worker->backend.wait = worker_wait;
+    worker->backend.accept = worker_accept;
+    worker->backend.close = worker_close;
+    snprintf(worker->name, sizeof(worker->name), "Worker %zu", id);
+
+    if (opts->acceptor) {
+        /* Room for every slot's connection, so that the ring only fills
+         * when the worker does.
+         */
+        if (ring_init(&worker->handoff, opts->max_connections) || open_wakeup(worker->handoff_wake)) {
+            release_worker(worker);
+            return 1;
+        }
+
+        worker->listener = worker->handoff_wake[0];
+    } else if (initialise_listening_socket(&worker->listener, opts, worker->cpu)) {
+        return 1;
+    }
+
+    err = open_wakeup(worker->wake) ? 0 : pthread_create(&worker->thread, NULL, run_worker, worker);
+
+    if (worker->wake[0] < 0 || err) {
+        if (err) {
+            errno = err;
+            perror("Failed to start worker");
+        }
+
+        if (!opts->acceptor)
+            close(worker->listener);
+
+        release_worker(worker);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/* Closes what the worker's thread does not: its wakeups, and connections
+ * still waiting to be handed over or migrated to it.
+ */
+static void release_worker(struct worker *worker) {
+    struct queue_link *link = queue_take(&worker->inbox);
+    void *entry;
+
+    while (link) {
+        struct migration *migration = (struct migration *) link;
+
+        link = link->next;
+        close(migration->handle);
+        free(migration);
+    }
+
+    if (worker->opts->acceptor) {
+        if (worker->handoff.entries) {
+            while (ring_pop(&worker->handoff, &entry))
+                close((int) (intptr_t) entry);
+
+            ring_destroy(&worker->handoff);
+        }
+
+        close_wakeup(worker->handoff_wake);
+    }
+
+    close_wakeup(worker->wake);
+}
+
+
+static void hand_off_connections(struct acceptor *acceptor) {
+    /* Take every pending connection request, waking each worker handed any
+     * once for the lot.
+     */
+    while (!acceptor->interrupted) {
+        struct worker *worker = &acceptor->workers[0];
+        size_t least = SIZE_MAX;
+
+        int s = accept(acceptor->listener, NULL, NULL);
+
+        if (s < 0) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("Failed to accept connection request");
+
+            break;
+        }
+
+        /* A worker's load is the connections it has been handed, including
+         * those still in its ring, and migrated, less those it has closed or
+         * migrated away, held at 0 as in worker_load(). Ties go round the
+         * workers in turn.
+         */
+        for (size_t k = 0U; k < acceptor->n; ++k) {
+            size_t i = (acceptor->next + k) % acceptor->n;
+            const struct worker *candidate = &acceptor->workers[i];
+            size_t closed = __atomic_load_n(&candidate->closed, __ATOMIC_RELAXED);
+            size_t total = acceptor->assigned[i] + __atomic_load_n(&candidate->migrated_in, __ATOMIC_RELAXED);
+            size_t load = total > closed ? total - closed : 0U;
+
+            if (load < least) {
+                least = load;
+                worker = &acceptor->workers[i];
+            }
+        }
+
+        acceptor->next = (worker->id + 1U) % acceptor->n;
+
+        if (!ring_push(&worker->handoff, (void *) (intptr_t) s)) {
+            fprintf(stderr, "[Acceptor] %s is full, closing connection\n", worker->name);
+            close(s);
+            continue;
+        }
+
+        ++acceptor->assigned[worker->id];
+        worker->handoff_pending = true;
+    }
+
+    for (size_t i = 0U; i < acceptor->n; ++i) {
+        if (acceptor->workers[i].handoff_pending) {
+            acceptor->workers[i].handoff_pending = false;
+            send_wakeup(acceptor->workers[i].handoff_wake);
+        }
+    }
+}
+
+
+static void *run_acceptor(void *arg) {
+    struct acceptor *acceptor = arg;
+
+    struct pollfd pfds[2] = {
+        {.fd = acceptor->listener, .events = POLLIN},
+        {.fd = acceptor->wake[0], .events = POLLIN}
+    };
+
+    while (!acceptor->interrupted) {
+        if (poll(pfds, 2U, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            perror("Failed to poll the listening socket");
+            acceptor->status = 1;
+
+            /* Bring the whole server down. */
+            kill(getpid(), SIGINT);
+            break;
+        }
+
+        if (pfds[1].revents)
+            drain_wakeup(pfds[1].fd);
+
+        if (pfds[0].revents)
+            hand_off_connections(acceptor);
+    }
+
+    return NULL;
+}
+
+
+static int start_acceptor(struct acceptor *acceptor, struct worker *workers, const struct server_options *opts) {
+    int err;
+
+    *acceptor = (struct acceptor) {
+        .listener = -1,
+        .wake = {-1, -1},
+        .workers = workers,
+        .n = opts->workers,
+        .assigned = calloc(opts->workers, sizeof(size_t))
+    };
+
+    if (!acceptor->assigned) {
+        perror("Failed to allocate acceptor");
+        return 1;
+    }
+
+    fprintf(stderr, "Initialising listening socket\n");
+    if (initialise_listening_socket(&acceptor->listener, opts, -1)) {
+        free(acceptor->assigned);
+        return 1;
+    }
+
+    err = open_wakeup(acceptor->wake) ? 0 : pthread_create(&acceptor->thread, NULL, run_acceptor, acceptor);
+
+    if (acceptor->wake[0] < 0 || err) {
+        if (err) {
+            errno = err;
+            perror("Failed to start acceptor");
+        }
+
+        close(acceptor->listener);
+        close_wakeup(acceptor->wake);
+        free(acceptor->assigned);
+        return 1;
+    }
+
+    return 0;
+}
+
+
+struct workers *workers_start(const struct server_options *opts, const struct server_handler *handler) {
+    struct workers *workers = calloc(1U, sizeof(*workers));
+    sigset_t all, mask;
+    int status = 0;
+
+    if (!workers || !(workers->workers = calloc(opts->workers, sizeof(struct worker)))) {
+        perror("Failed to allocate workers");
+        free(workers);
+        return NULL;
+    }
+
+    workers->opts = opts;
+    raise_file_limit(opts->workers * opts->max_connections);
+
+    /* Signals are the caller's to take, so every thread is started with
+     * them all blocked.
+     */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &mask);
+
+    fprintf(stderr, "Starting %zu workers\n", opts->workers);
+    for (; workers->n < opts->workers; ++workers->n) {
+        if (start_worker(&workers->workers[workers->n], workers->n, opts, handler)) {
+            status = 1;
+            break;
+        }
+    }
+
+    /* Only once every worker can be handed connections. */
+    if (!status && opts->acceptor) {
+        fprintf(stderr, "Starting acceptor\n");
+        status = start_acceptor(&workers->acceptor, workers->workers, opts);
+        workers->accepting = !status;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &mask, NULL);
+
+    if (status) {
+        workers_stop(workers);
+        return NULL;
+    }
+
+    return workers;
+}
+
+
+void workers_report(struct workers *workers) {
+    for (size_t i = 0U; i < workers->n; ++i) {
+        workers->workers[i].report = 1;
+        send_wakeup(workers->workers[i].wake);
+    }
+}
+
+
+void workers_balance(struct workers *workers) {
+    balance_workers(workers->workers, workers->n);
+}
+
+
+int workers_stop(struct workers *workers) {
+    struct acceptor *acceptor = &workers->acceptor;
+    int status = 0;
+
+    /* The acceptor stops first, so that nothing is handed to a worker that
+     * has stopped.
+     */
+    if (workers->accepting) {
+        acceptor->interrupted = 1;
+        send_wakeup(acceptor->wake);
+        pthread_join(acceptor->thread, NULL);
+
+        close(acceptor->listener);
+        close_wakeup(acceptor->wake);
+        free(acceptor->assigned);
+        status |= acceptor->status;
+    }
+
+    for (size_t i = 0U; i < workers->n; ++i) {
+        workers->workers[i].interrupted = 1;
+        send_wakeup(workers->workers[i].wake);
+    }
+
+    for (size_t i = 0U; i < workers->n; ++i)
+        pthread_join(workers->workers[i].thread, NULL);
+
+    /* Only once all have stopped, as any may migrate to any other. */
+    for (size_t i = 0U; i < workers->n; ++i) {
+        release_worker(&workers->workers[i]);
+        status |= workers->workers[i].status;
+    }
+
+    free(workers->workers);
+    free(workers);
+    return status;
+}
@@ -0,0 +1,38 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include "timeout_server.h"
+
+
+/* Event loops on threads of their own, one pinned to each of the options'
+ * CPUs, each with its own timer engine and slots. Each listens on the port
+ * with its own socket, or is handed connections by an acceptor thread, and
+ * connections are moved between them to balance them, as the options ask.
+ *
+ * The threads are started with every signal blocked, leaving signals to the
+ * caller. A worker that fails raises SIGINT, for the caller to stop them
+ * all.
+ */
+
+struct workers;
+
+/* Start the workers, all with the one handler, whose callbacks they make at
+ * once from their own threads, each with its own server. Returns NULL on
+ * failure.
+ */
+struct workers *workers_start(const struct server_options *opts, const struct server_handler *handler);
+
+/* Have every worker report its memory use and waits. */
+void workers_report(struct workers *workers);
+
+/* Have the busiest worker move connections to the least busy, if they are
+ * far enough apart.
+ */
+void workers_balance(struct workers *workers);
+
+/* Stop the workers, closing their connections, and free them. Returns 1 if
+ * any failed.
+ */
+int workers_stop(struct workers *workers);
+
+#endif